@@ -33,19 +33,6 @@ if ! test -d "${dir}"; then
 fi
 cd "${dir}" || exit 1
 
-# detect git push -f
-force=0
-while read -r old new ref; do
-	test "${old}" = "0000000000000000000000000000000000000000" && continue
-	test "${new}" = "0000000000000000000000000000000000000000" && continue
-
-	hasrevs=$(git rev-list "${old}" "^${new}" | sed 1q)
-	if test -n "${hasrevs}"; then
-		force=1
-		break
-	fi
-done
-
 # strip .git suffix.
 r=$(basename "${name}")
 d=$(basename "${name}" ".git")
@@ -54,17 +41,12 @@ printf "[%s] stagit HTML pages... " "${d}"
 mkdir -p "${destdir}/${d}"
 cd "${destdir}/${d}" || exit 1
 
-# remove commits and ${cachefile} on git push -f, this recreated later on.
-if test "${force}" = "1"; then
-	rm -f "${cachefile}"
-	rm -rf "commit"
-fi
-
 # make index.
 stagit-index "${reposdir}/"*/ > "${destdir}/index.html"
 
-# make pages.
-stagit -c "${cachefile}" "${reposdir}/${r}"
+# make pages: only the pages of the ref updates on stdin, the commits which
+# are not in the history anymore after a git push -f are removed.
+stagit -r -c "${cachefile}" "${reposdir}/${r}"
 
 ln -sf log.html index.html
 ln -sf ../style.css style.css
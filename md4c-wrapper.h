@@ -33,7 +33,7 @@ md4c_buffer_cb(const MD_CHAR *data, MD_SIZE size, void *ud)
 
 /* Convert relative .md links to .md.html in HTML */
 static void
-convert_md_links(FILE *fp, const char *html, size_t len)
+convert_md_links(struct obuf *ob, const char *html, size_t len)
 {
 	size_t i = 0;
 	while (i < len) {
@@ -42,7 +42,7 @@ convert_md_links(FILE *fp, const char *html, size_t len)
 		    html[i] == 'h' && html[i+1] == 'r' && html[i+2] == 'e' && 
 		    html[i+3] == 'f' && html[i+4] == '=' && html[i+5] == '"') {
 			
-			fwrite(&html[i], 1, 6, fp); /* write href=" */
+			bwrite(ob, &html[i], 6); /* write href=" */
 			i += 6;
 			
 			/* Capture the URL until the closing " */
@@ -75,26 +75,26 @@ convert_md_links(FILE *fp, const char *html, size_t len)
 					
 					if (is_md) {
 						/* Write URL up to the extension */
-						fwrite(url, 1, ext - url, fp);
+						bwrite(ob, url, ext - url);
 						/* Write extension + .html */
 						size_t ext_len = 0;
 						while (ext[ext_len] && ext[ext_len] != '"' && ext[ext_len] != '#') 
 							ext_len++;
-						fwrite(ext, 1, ext_len, fp);
-						fputs(".html", fp);
+						bwrite(ob, ext, ext_len);
+						bputs(ob, ".html");
 						/* Write rest of URL (anchor, etc) */
-						fwrite(&ext[ext_len], 1, url_len - (ext - url) - ext_len, fp);
+						bwrite(ob, &ext[ext_len], url_len - (ext - url) - ext_len);
 					} else {
-						fwrite(url, 1, url_len, fp);
+						bwrite(ob, url, url_len);
 					}
 				} else {
-					fwrite(url, 1, url_len, fp);
+					bwrite(ob, url, url_len);
 				}
 			} else {
-				fwrite(&html[url_start], 1, url_len, fp);
+				bwrite(ob, &html[url_start], url_len);
 			}
 		} else {
-			fputc(html[i], fp);
+			bputc(ob, html[i]);
 			i++;
 		}
 	}
@@ -115,7 +115,7 @@ is_markdown_filename(const char *name)
 
 /* Render Markdown to HTML with link conversion (for stagit) */
 static int
-render_markdown_with_links(FILE *fp, const char *buf, size_t len)
+render_markdown_with_links(struct obuf *ob, const char *buf, size_t len)
 {
 	struct md_buffer output = {0};
 	unsigned parser_flags = MD_DIALECT_GITHUB;
@@ -130,7 +130,7 @@ render_markdown_with_links(FILE *fp, const char *buf, size_t len)
 	
 	if (ret == 0 && output.data && output.size > 0) {
 		/* Convert .md links to .md.html and write to file */
-		convert_md_links(fp, output.data, output.size);
+		convert_md_links(ob, output.data, output.size);
 	}
 	
 	free(output.data);
@@ -139,7 +139,7 @@ render_markdown_with_links(FILE *fp, const char *buf, size_t len)
 
 /* Render Markdown to HTML without link conversion (for stagit-index) */
 static int
-render_markdown(FILE *fp, const char *buf, size_t len)
+render_markdown(struct obuf *ob, const char *buf, size_t len)
 {
 	struct md_buffer output = {0};
 	unsigned parser_flags = MD_DIALECT_GITHUB;
@@ -150,7 +150,7 @@ render_markdown(FILE *fp, const char *buf, size_t len)
 	                  parser_flags, renderer_flags);
 	
 	if (ret == 0 && output.data && output.size > 0) {
-		fwrite(output.data, 1, output.size, fp);
+		bwrite(ob, output.data, output.size);
 	}
 	
 	free(output.data);
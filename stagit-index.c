@@ -1,5 +1,9 @@
+#include <sys/stat.h>
+
 #include <err.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,26 +12,63 @@
 
 #include <git2.h>
 
+#include "util.h"
+
 #include "md4c-wrapper.h"
 
-static git_repository *repo;
+/* a repository of the index, its row is written by a worker thread */
+struct indexrepo {
+	const char *dir;
+	char path[PATH_MAX + 1]; /* absolute, the key in the cache */
+	git_oid head;
+	long long descmtime, ownermtime;
+	const char *row;         /* written or from the cache */
+	size_t rowlen;
+	char *rowbuf;            /* a written row, to free */
+	int failed;              /* the repository could not be opened */
+	int hashead;             /* an empty repository has no row */
+	int done;
+};
+
+/* metadata cache record: the row of a repository is kept as long as its
+   HEAD and the modification times of its description and owner files */
+struct cacherec {
+	const char *path;
+	git_oid head;
+	long long descmtime, ownermtime;
+	const char *row;
+	size_t rowlen;
+};
+
+static _Thread_local git_repository *repo;
 
 static const char *relpath = "";
 
-static char description[255] = "Repositories";
-static char *name = "";
-static char owner[255];
+static _Thread_local char description[255] = "Repositories";
+static _Thread_local char *name = "";
+static _Thread_local char owner[255];
 
 /* 追加：README 候補（順に優先）*/
 static const char *readme_candidates[] = {
-    "HEAD:README.md",
-    "HEAD:README.markdown",
-    "HEAD:README.mdown",
-    "HEAD:README.mkd",
-    "HEAD:README"
+    "README.md",
+    "README.markdown",
+    "README.mdown",
+    "README.mkd",
+    "README"
 };
 static const size_t n_readme_candidates = sizeof(readme_candidates)/sizeof(readme_candidates[0]);
 
+static long long nthreads = 1;
+static struct indexrepo *irs;
+static size_t nirs, nextir;
+static pthread_mutex_t irlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ircond = PTHREAD_COND_INITIALIZER;
+
+static const char *cachefile;
+static char *cachedata;
+static struct cacherec *cacherecs;
+static size_t ncacherecs;
+
 void
 joinpath(char *buf, size_t bufsiz, const char *path, const char *path2)
 {
@@ -40,81 +81,63 @@ joinpath(char *buf, size_t bufsiz, const char *path, const char *path2)
 			path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
 }
 
-/* Escape characters below as HTML 2.0 / XML 1.0. */
 void
-xmlencode(FILE *fp, const char *s, size_t len)
+printtimeshort(struct obuf *ob, const git_time *intime)
 {
-	size_t i;
-
-	for (i = 0; *s && i < len; s++, i++) {
-		switch(*s) {
-		case '<':  fputs("&lt;",   fp); break;
-		case '>':  fputs("&gt;",   fp); break;
-		case '\'': fputs("&#39;" , fp); break;
-		case '&':  fputs("&amp;",  fp); break;
-		case '"':  fputs("&quot;", fp); break;
-		default:   fputc(*s, fp);
-		}
-	}
-}
-
-void
-printtimeshort(FILE *fp, const git_time *intime)
-{
-	struct tm *intm;
+	struct tm tm, *intm;
 	time_t t;
 	char out[32];
 
 	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
+	if (!(intm = gmtime_r(&t, &tm)))
 		return;
 	strftime(out, sizeof(out), "%Y-%m-%d %H:%M", intm);
-	fputs(out, fp);
+	bputs(ob, out);
 }
 
 void
-writeheader(FILE *fp)
+writeheader(struct obuf *ob)
 {
-	fputs("<!DOCTYPE html>\n"
+	bputs(ob, "<!DOCTYPE html>\n"
 		"<html>\n<head>\n"
 		"<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
 		"<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\" />\n"
-		"<title>", fp);
-	xmlencode(fp, description, strlen(description));
-	fprintf(fp, "</title>\n<link rel=\"icon\" type=\"image/png\" href=\"%sfavicon.png\" />\n", relpath);
-	fprintf(fp, "<link rel=\"stylesheet\" type=\"text/css\" href=\"%sstyle.css\" />\n", relpath);
-	fputs("</head>\n<body>\n", fp);
+		"<title>");
+	xmlencode(ob, description, strlen(description));
+	bprintf(ob, "</title>\n<link rel=\"icon\" type=\"image/png\" href=\"%sfavicon.png\" />\n", relpath);
+	bprintf(ob, "<link rel=\"stylesheet\" type=\"text/css\" href=\"%sstyle.css\" />\n", relpath);
+	bputs(ob, "</head>\n<body>\n");
 	
 	/* Theme toggle button */
-	fputs("<button id=\"theme-toggle\" aria-label=\"Toggle dark mode\" title=\"Toggle theme\">🌓</button>\n", fp);
+	bputs(ob, "<button id=\"theme-toggle\" aria-label=\"Toggle dark mode\" title=\"Toggle theme\">🌓</button>\n");
 	
 	/* Header */
-	fputs("<header class=\"repo-header\"><div class=\"container\">\n", fp);
-	fputs("<div class=\"repo-title\">", fp);
-	fprintf(fp, "<img src=\"%slogo.png\" alt=\"\" width=\"24\" height=\"24\" />", relpath);
-	fputs("<h1>", fp);
-	xmlencode(fp, description, strlen(description));
-	fputs("</h1>", fp);
-	fputs("<span class=\"desc\">Git Repositories</span>", fp);
-	fputs("</div>\n", fp);
-	fputs("</div></header>\n", fp);
+	bputs(ob, "<header class=\"repo-header\"><div class=\"container\">\n");
+	bputs(ob, "<div class=\"repo-title\">");
+	bprintf(ob, "<img src=\"%slogo.png\" alt=\"\" width=\"24\" height=\"24\" />", relpath);
+	bputs(ob, "<h1>");
+	xmlencode(ob, description, strlen(description));
+	bputs(ob, "</h1>");
+	bputs(ob, "<span class=\"desc\">Git Repositories</span>");
+	bputs(ob, "</div>\n");
+	bputs(ob, "</div></header>\n");
 	
 	/* Main content wrapper */
-	fputs("<main><div id=\"content\" class=\"container\">\n", fp);
+	bputs(ob, "<main><div id=\"content\" class=\"container\">\n");
 	
 	/* Search box */
-	fputs("<div class=\"file-search\">\n", fp);
-	fputs("<input type=\"search\" id=\"repo-search\" placeholder=\"Find repository...\" aria-label=\"Search repositories\" />\n", fp);
-	fputs("</div>\n", fp);
+	bputs(ob, "<div class=\"file-search\">\n");
+	bputs(ob, "<input type=\"search\" id=\"repo-search\" placeholder=\"Find repository...\" aria-label=\"Search repositories\" />\n");
+	bputs(ob, "</div>\n");
 	
-	fputs("<table id=\"index\"><thead>\n"
+	bputs(ob, "<table id=\"index\"><thead>\n"
 		"<tr><td><b>Name</b></td><td><b>Description</b></td><td><b>Owner</b></td>"
 		"<td><b>Last commit</b></td></tr>"
-		"</thead><tbody>\n", fp);
+		"</thead><tbody>\n");
 }
 
 void
-write_readme_section(FILE *fp, const char *readme_path)
+write_readme_section(struct obuf *ob, const char *readme_path)
 {
 #ifdef WITH_MD4C
 	FILE *readme_fp;
@@ -137,10 +160,10 @@ write_readme_section(FILE *fp, const char *readme_path)
 	fclose(readme_fp);
 	
 	if (size > 0) {
-		fputs("<div class=\"readme-section\">\n", fp);
-		fputs("<div class=\"readme-content\">\n", fp);
-		render_markdown(fp, content, size);
-		fputs("</div>\n</div>\n", fp);
+		bputs(ob, "<div class=\"readme-section\">\n");
+		bputs(ob, "<div class=\"readme-content\">\n");
+		render_markdown(ob, content, size);
+		bputs(ob, "</div>\n</div>\n");
 	}
 	
 	free(content);
@@ -148,17 +171,17 @@ write_readme_section(FILE *fp, const char *readme_path)
 }
 
 void
-writefooter(FILE *fp)
+writefooter(struct obuf *ob)
 {
-	fputs("</tbody>\n</table>\n", fp);
+	bputs(ob, "</tbody>\n</table>\n");
 	
 	/* Try to display README.md from current directory */
-	write_readme_section(fp, "README.md");
+	write_readme_section(ob, "README.md");
 	
-	fputs("</div></main>\n", fp);
+	bputs(ob, "</div></main>\n");
 	
 	/* JavaScript for theme toggle and search */
-	fputs("<script>\n"
+	bputs(ob, "<script>\n"
 		"/* Theme toggle */\n"
 		"(function(){\n"
 		"  var toggle=document.getElementById('theme-toggle');\n"
@@ -201,35 +224,23 @@ writefooter(FILE *fp)
 		"    }\n"
 		"  });\n"
 		"})();\n"
-		"</script>\n", fp);
+		"</script>\n");
 	
-	fputs("</body>\n</html>\n", fp);
+	bputs(ob, "</body>\n</html>\n");
 }
 
 int
-writelog(FILE *fp)
+writelog(struct obuf *ob, const git_oid *id)
 {
 	git_commit *commit = NULL;
+	git_tree *tree = NULL;
 	const git_signature *author;
-	git_revwalk *w = NULL;
-	git_oid id;
 	char *stripped_name = NULL, *p;
-	char readme_path[255];
 	const char *readme_link = NULL;
-	git_object *readme_obj = NULL;
 	size_t i;
-	int ret = 0;
-
-	git_revwalk_new(&w, repo);
-	git_revwalk_push_head(w);
-	git_revwalk_simplify_first_parent(w);
-
-	if (git_revwalk_next(&id, w) ||
-	    git_commit_lookup(&commit, repo, &id)) {
-		ret = -1;
-		goto err;
-	}
 
+	if (git_commit_lookup(&commit, repo, id))
+		return -1;
 	author = git_commit_author(commit);
 
 	/* strip .git suffix */
@@ -239,127 +250,367 @@ writelog(FILE *fp)
 		if (!strcmp(p, ".git"))
 			*p = '\0';
 
-	/* Find README file (try candidates in order) */
-	for (i = 0; i < n_readme_candidates; i++) {
-		if (!git_revparse_single(&readme_obj, repo, readme_candidates[i])) {
-			/* Extract filename from "HEAD:filename" */
-			const char *colon = strchr(readme_candidates[i], ':');
-			if (colon) {
-				readme_link = colon + 1;
+	/* Find README file (try candidates in order), the entries belong to
+	   the tree */
+	if (!git_commit_tree(&tree, commit)) {
+		for (i = 0; i < n_readme_candidates; i++) {
+			if (git_tree_entry_byname(tree, readme_candidates[i])) {
+				readme_link = readme_candidates[i];
 				break;
 			}
-			git_object_free(readme_obj);
-			readme_obj = NULL;
 		}
 	}
 
 	/* Repository row with icon */
-	fputs("<tr><td>", fp);
+	bputs(ob, "<tr><td>");
 	/* Repository icon (folder SVG) */
-	fputs("<svg width=\"16\" height=\"16\" viewBox=\"0 0 24 24\" fill=\"currentColor\" style=\"vertical-align:middle;margin-right:6px;\" aria-hidden=\"true\">" 
-	      "<path d=\"M4 5.5A1.5 1.5 0 0 1 5.5 4h4.38c.4 0 .78.16 1.06.44l1.12 1.12c.28.28.66.44 1.06.44H18.5A1.5 1.5 0 0 1 20 7.5v10A2.5 2.5 0 0 1 17.5 20h-11A2.5 2.5 0 0 1 4 17.5v-12Z\"/>" 
-	      "</svg>", fp);
+	bputs(ob, "<svg width=\"16\" height=\"16\" viewBox=\"0 0 24 24\" fill=\"currentColor\" style=\"vertical-align:middle;margin-right:6px;\" aria-hidden=\"true\">" 
+	          "<path d=\"M4 5.5A1.5 1.5 0 0 1 5.5 4h4.38c.4 0 .78.16 1.06.44l1.12 1.12c.28.28.66.44 1.06.44H18.5A1.5 1.5 0 0 1 20 7.5v10A2.5 2.5 0 0 1 17.5 20h-11A2.5 2.5 0 0 1 4 17.5v-12Z\"/>" 
+	          "</svg>");
 	
 	/* Link to log.html or README */
 	if (readme_link) {
-		fprintf(fp, "<a href=\"%s/file/", stripped_name);
-		xmlencode(fp, readme_link, strlen(readme_link));
-		fputs(".html\">", fp);
+		bprintf(ob, "<a href=\"%s/file/", stripped_name);
+		xmlencode(ob, readme_link, strlen(readme_link));
+		bputs(ob, ".html\">");
 	} else {
-		fprintf(fp, "<a href=\"%s/log.html\">", stripped_name);
+		bprintf(ob, "<a href=\"%s/log.html\">", stripped_name);
 	}
-	xmlencode(fp, stripped_name, strlen(stripped_name));
-	fputs("</a></td><td>", fp);
-	xmlencode(fp, description, strlen(description));
-	fputs("</td><td>", fp);
-	xmlencode(fp, owner, strlen(owner));
-	fputs("</td><td>", fp);
+	xmlencode(ob, stripped_name, strlen(stripped_name));
+	bputs(ob, "</a></td><td>");
+	xmlencode(ob, description, strlen(description));
+	bputs(ob, "</td><td>");
+	xmlencode(ob, owner, strlen(owner));
+	bputs(ob, "</td><td>");
 	if (author)
-		printtimeshort(fp, &(author->when));
-	fputs("</td></tr>\n", fp);
+		printtimeshort(ob, &(author->when));
+	bputs(ob, "</td></tr>\n");
 
-	if (readme_obj)
-		git_object_free(readme_obj);
+	git_tree_free(tree);
 	git_commit_free(commit);
-err:
-	git_revwalk_free(w);
 	free(stripped_name);
 
-	return ret;
+	return 0;
+}
+
+/* find file or .git/file of the repository, returns its modification time
+   in nanoseconds or 0 if there is none */
+long long
+metapath(char *buf, size_t bufsiz, const char *repodir, const char *file)
+{
+	struct stat st;
+	char gitfile[64];
+
+	joinpath(buf, bufsiz, repodir, file);
+	if (stat(buf, &st) == -1) {
+		snprintf(gitfile, sizeof(gitfile), ".git/%s", file);
+		joinpath(buf, bufsiz, repodir, gitfile);
+		if (stat(buf, &st) == -1)
+			return 0;
+	}
+	return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
 }
 
 int
-main(int argc, char *argv[])
+cacherec_cmp(const void *a, const void *b)
 {
+	return strcmp(((const struct cacherec *)a)->path,
+	              ((const struct cacherec *)b)->path);
+}
+
+/* read the metadata cache (does not need to exist): a line
+   "oid descmtime ownermtime rowlen path" and the row per repository */
+void
+cacheload(void)
+{
+	struct cacherec *cr;
+	struct stat st;
+	size_t cap = 0;
+	char *line, *next, *p, *end;
 	FILE *fp;
-	char path[PATH_MAX], repodirabs[PATH_MAX + 1];
-	const char *repodir;
-	int i, ret = 0;
 
-	if (argc < 2) {
-		fprintf(stderr, "%s [repodir...]\n", argv[0]);
-		return 1;
+	if (!(fp = fopen(cachefile, "r"))) {
+		if (errno == ENOENT)
+			return;
+		err(1, "fopen: '%s'", cachefile);
+	}
+	if (fstat(fileno(fp), &st) == -1)
+		err(1, "fstat: '%s'", cachefile);
+	if (!(cachedata = malloc((size_t)st.st_size + 1)))
+		err(1, "malloc");
+	if (fread(cachedata, 1, st.st_size, fp) != (size_t)st.st_size)
+		err(1, "fread: '%s'", cachefile);
+	fclose(fp);
+	cachedata[st.st_size] = '\0';
+	end = cachedata + st.st_size;
+
+	for (line = cachedata; line < end; line = next) {
+		if (!(next = strchr(line, '\n')))
+			errx(1, "%s: invalid cache", cachefile);
+		*next++ = '\0';
+		if (ncacherecs == cap) {
+			cap = cap ? cap * 2 : 256;
+			if (!(cacherecs = reallocarray(cacherecs, cap, sizeof(*cacherecs))))
+				err(1, "realloc");
+		}
+		cr = &cacherecs[ncacherecs++];
+		if (strlen(line) < GIT_OID_HEXSZ + 1 || line[GIT_OID_HEXSZ] != ' ')
+			errx(1, "%s: invalid cache", cachefile);
+		line[GIT_OID_HEXSZ] = '\0';
+		if (git_oid_fromstr(&cr->head, line))
+			errx(1, "%s: invalid object id", cachefile);
+		cr->descmtime = strtoll(line + GIT_OID_HEXSZ + 1, &p, 10);
+		if (*p != ' ')
+			errx(1, "%s: invalid cache", cachefile);
+		cr->ownermtime = strtoll(p + 1, &p, 10);
+		if (*p != ' ')
+			errx(1, "%s: invalid cache", cachefile);
+		cr->rowlen = strtoull(p + 1, &p, 10);
+		if (*p != ' ' || cr->rowlen > (size_t)(end - next))
+			errx(1, "%s: invalid cache", cachefile);
+		cr->path = p + 1;
+		cr->row = next;
+		next += cr->rowlen;
 	}
+	qsort(cacherecs, ncacherecs, sizeof(*cacherecs), cacherec_cmp);
+}
+
+struct cacherec *
+cacheget(const char *path)
+{
+	struct cacherec key = { .path = path };
+
+	if (!ncacherecs)
+		return NULL;
+	return bsearch(&key, cacherecs, ncacherecs, sizeof(*cacherecs),
+	               cacherec_cmp);
+}
+
+/* write the metadata cache of the repositories of this run */
+void
+cachewrite(void)
+{
+	char tmppath[PATH_MAX], buf[GIT_OID_HEXSZ + 1];
+	struct indexrepo *ir;
+	size_t i;
+	mode_t mask;
+	FILE *fp;
+	int fd, r;
+
+	r = snprintf(tmppath, sizeof(tmppath), "%s.XXXXXXXXXXXX", cachefile);
+	if (r < 0 || (size_t)r >= sizeof(tmppath))
+		errx(1, "path truncated: '%s.XXXXXXXXXXXX'", cachefile);
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	for (i = 0; i < nirs; i++) {
+		ir = &irs[i];
+		if (!ir->hashead || !ir->row)
+			continue;
+		git_oid_tostr(buf, sizeof(buf), &ir->head);
+		fprintf(fp, "%s %lld %lld %zu %s\n", buf, ir->descmtime,
+		        ir->ownermtime, ir->rowlen, ir->path);
+		fwrite(ir->row, 1, ir->rowlen, fp);
+	}
+	if (fflush(fp) || ferror(fp))
+		err(1, "fwrite: '%s'", tmppath);
+	fclose(fp);
+
+	if (rename(tmppath, cachefile))
+		err(1, "rename: '%s' to '%s'", tmppath, cachefile);
+	umask((mask = umask(0)));
+	if (chmod(cachefile,
+	    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+		err(1, "chmod: '%s'", cachefile);
+}
+
+/* read the first line of a metadata file */
+void
+readmeta(char *buf, size_t bufsiz, const char *path)
+{
+	FILE *fp;
+
+	buf[0] = '\0';
+	if (!(fp = fopen(path, "r")))
+		return;
+	if (!fgets(buf, bufsiz, fp))
+		buf[0] = '\0';
+	fclose(fp);
+}
+
+/* write the row of a repository, or take it from the cache */
+void
+indexrepo(struct indexrepo *ir)
+{
+	struct cacherec *cr;
+	struct obuf ob;
+	char descpath[PATH_MAX], ownerpath[PATH_MAX];
+
+	if (!realpath(ir->dir, ir->path))
+		err(1, "realpath");
+
+	if (git_repository_open_ext(&repo, ir->dir,
+	    GIT_REPOSITORY_OPEN_NO_SEARCH, NULL)) {
+		ir->failed = 1;
+		return;
+	}
+	if (git_reference_name_to_id(&ir->head, repo, "HEAD"))
+		goto done;
+	ir->hashead = 1;
+
+	ir->descmtime = metapath(descpath, sizeof(descpath), ir->dir, "description");
+	ir->ownermtime = metapath(ownerpath, sizeof(ownerpath), ir->dir, "owner");
+	if ((cr = cacheget(ir->path)) && !git_oid_cmp(&cr->head, &ir->head) &&
+	    cr->descmtime == ir->descmtime && cr->ownermtime == ir->ownermtime) {
+		ir->row = cr->row;
+		ir->rowlen = cr->rowlen;
+		goto done;
+	}
+
+	/* use directory name as name */
+	if ((name = strrchr(ir->path, '/')))
+		name++;
+	else
+		name = "";
+
+	/* read description or .git/description */
+	readmeta(description, sizeof(description), descpath);
+
+	/* read owner or .git/owner */
+	readmeta(owner, sizeof(owner), ownerpath);
+	owner[strcspn(owner, "\n")] = '\0';
+
+	binit(&ob, -1, "index row");
+	if (writelog(&ob, &ir->head)) {
+		free(ob.buf);
+	} else {
+		ir->row = ir->rowbuf = ob.buf;
+		ir->rowlen = ob.len;
+	}
+done:
+	git_repository_free(repo);
+	repo = NULL;
+}
+
+void *
+indexworker(void *arg)
+{
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&irlock);
+		i = nextir++;
+		pthread_mutex_unlock(&irlock);
+		if (i >= nirs)
+			break;
+
+		indexrepo(&irs[i]);
+
+		pthread_mutex_lock(&irlock);
+		irs[i].done = 1;
+		pthread_cond_broadcast(&ircond);
+		pthread_mutex_unlock(&irlock);
+	}
+
+	return NULL;
+}
+
+void
+usage(char *argv0)
+{
+	fprintf(stderr, "%s [-c cachefile] [-j jobs] [repodir...]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct obuf ob;
+	pthread_t *threads;
+	char *p;
+	size_t i, n;
+	int r, ret = 0;
+
+	for (i = 1; i < (size_t)argc && argv[i][0] == '-'; i++) {
+		if (argv[i][1] == 'c') {
+			if (i + 1 >= (size_t)argc)
+				usage(argv[0]);
+			cachefile = argv[++i];
+		} else if (argv[i][1] == 'j') {
+			if (i + 1 >= (size_t)argc)
+				usage(argv[0]);
+			errno = 0;
+			nthreads = strtoll(argv[++i], &p, 10);
+			if (argv[i][0] == '\0' || *p != '\0' ||
+			    nthreads <= 0 || errno)
+				usage(argv[0]);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (i >= (size_t)argc)
+		usage(argv[0]);
+	nirs = argc - i;
+	if (!(irs = calloc(nirs, sizeof(*irs))))
+		err(1, "calloc");
+	for (n = 0; n < nirs; n++)
+		irs[n].dir = argv[i + n];
 
 	git_libgit2_init();
 
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath", NULL) == -1)
-		err(1, "pledge");
+	if (cachefile) {
+		if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
+			err(1, "pledge");
+	} else {
+		if (pledge("stdio rpath", NULL) == -1)
+			err(1, "pledge");
+	}
 #endif
 
-	writeheader(stdout);
-
-	for (i = 1; i < argc; i++) {
-		repodir = argv[i];
-		if (!realpath(repodir, repodirabs))
-			err(1, "realpath");
-
-		if (git_repository_open_ext(&repo, repodir,
-		    GIT_REPOSITORY_OPEN_NO_SEARCH, NULL)) {
+	if (cachefile)
+		cacheload();
+
+	binit(&ob, STDOUT_FILENO, "<stdout>");
+	writeheader(&ob);
+
+	/* the rows are written in the order of the arguments as they are done */
+	n = nthreads < (long long)nirs ? (size_t)nthreads : nirs;
+	if (!(threads = calloc(n, sizeof(*threads))))
+		err(1, "calloc");
+	for (i = 0; i < n; i++)
+		if ((r = pthread_create(&threads[i], NULL, indexworker, NULL)))
+			errx(1, "pthread_create: %s", strerror(r));
+	for (i = 0; i < nirs; i++) {
+		pthread_mutex_lock(&irlock);
+		while (!irs[i].done)
+			pthread_cond_wait(&ircond, &irlock);
+		pthread_mutex_unlock(&irlock);
+
+		if (irs[i].failed) {
 			fprintf(stderr, "%s: cannot open repository\n", argv[0]);
 			ret = 1;
-			continue;
+		} else if (irs[i].row) {
+			bwrite(&ob, irs[i].row, irs[i].rowlen);
 		}
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
 
-		/* use directory name as name */
-		if ((name = strrchr(repodirabs, '/')))
-			name++;
-		else
-			name = "";
-
-		/* read description or .git/description */
-		joinpath(path, sizeof(path), repodir, "description");
-		if (!(fp = fopen(path, "r"))) {
-			joinpath(path, sizeof(path), repodir, ".git/description");
-			fp = fopen(path, "r");
-		}
-		description[0] = '\0';
-		if (fp) {
-			if (!fgets(description, sizeof(description), fp))
-				description[0] = '\0';
-			fclose(fp);
-		}
+	writefooter(&ob);
+	bclose(&ob);
 
-		/* read owner or .git/owner */
-		joinpath(path, sizeof(path), repodir, "owner");
-		if (!(fp = fopen(path, "r"))) {
-			joinpath(path, sizeof(path), repodir, ".git/owner");
-			fp = fopen(path, "r");
-		}
-		owner[0] = '\0';
-		if (fp) {
-			if (!fgets(owner, sizeof(owner), fp))
-				owner[0] = '\0';
-			owner[strcspn(owner, "\n")] = '\0';
-			fclose(fp);
-		}
-		writelog(stdout);
-	}
-	writefooter(stdout);
+	if (cachefile)
+		cachewrite();
 
 	/* cleanup */
-	git_repository_free(repo);
+	for (i = 0; i < nirs; i++)
+		free(irs[i].rowbuf);
+	free(irs);
+	free(cacherecs);
+	free(cachedata);
 	git_libgit2_shutdown();
 
 	return ret;
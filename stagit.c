@@ -1,10 +1,15 @@
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
-#include <libgen.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,11 +20,35 @@
 #include <git2.h>
 
 #include "compat.h"
+#include "util.h"
 
 #include "md4c-wrapper.h"
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+/* bump allocator for the bookkeeping of one commit, reset per commit */
+struct arenablock {
+	struct arenablock *next;
+	size_t size, used;
+};
+
+struct arena {
+	struct arenablock *blocks;
+};
+
+/* allocations for the commits of the log, reported with -v */
+struct allocstats {
+	size_t ncommits;
+	size_t narena;     /* served by the arena, each was a calloc() */
+	size_t nblocks;    /* arena blocks malloc()'d */
+	size_t nheap;      /* other heap allocations: memory streams */
+	size_t arenasize;  /* largest arena block */
+};
+
 struct deltainfo {
-	git_patch *patch;
+	const git_diff_delta *delta;
 
 	size_t addcount;
 	size_t delcount;
@@ -46,8 +75,118 @@ struct commitinfo {
 	size_t delcount;
 	size_t filecount;
 
-	struct deltainfo **deltas;
+	struct deltainfo *deltas;
 	size_t ndeltas;
+
+	char *hunks;    /* diff of the deltas as HTML */
+	size_t hunkslen;
+
+	struct arena *arena; /* allocated from, NULL for the heap */
+};
+
+/* log entry of a commit in revwalk order, filled in by logjob_run() */
+struct logjob {
+	git_oid id;
+	int exists;     /* commit file exists already */
+	int done;
+	int status;     /* -1: stop the log, 0: row written, 1: no row */
+	int hasparent;
+	int newstats;   /* diffstat is not in the stats store yet */
+
+	size_t addcount;
+	size_t delcount;
+	size_t filecount;
+
+	char *row;      /* log.html table row */
+	size_t rowlen;
+};
+
+/* With the simplified first parent history the parent of a commit is the
+   next commit of the log and its tree is the tree the commit was diffed
+   against: they are kept to not look them up and parse them again. */
+struct logwindow {
+	git_commit *commit;
+	git_tree *tree;
+};
+
+/* state of a thread writing the log */
+struct logctx {
+	struct logwindow window;
+	struct arena arena;
+	struct allocstats stats;
+};
+
+/* diffstat store record, sorted by object id, counts are big-endian */
+struct statsrec {
+	unsigned char oid[GIT_OID_RAWSZ];
+	unsigned char filecount[4];
+	unsigned char addcount[4];
+	unsigned char delcount[4];
+};
+
+/* file cache record: a file page of the last run */
+struct filerec {
+	const char *path;
+	long long lc; /* line count or -1 */
+	unsigned long long size;
+};
+
+/* entry of the tree of HEAD, in the order of the rows of files.html */
+struct fileentry {
+	char *path;
+	size_t namepos; /* name of the entry in path */
+	int depth;
+	int type;       /* GIT_OBJ_TREE, GIT_OBJ_BLOB or GIT_OBJ_COMMIT */
+	git_filemode_t mode;
+	git_oid id;
+	int page;       /* how the page of a file is written, see below */
+	size_t src;     /* entry of the page linked to */
+	long long lc;   /* line count or -1 */
+	unsigned long long size;
+};
+
+enum { PAGENONE, PAGEWRITE, PAGELINK, PAGEKEPT };
+
+/* file page of this run: a page of the same blob, name and directory depth
+   has the same content and is written as a hard link to it */
+struct blobpage {
+	git_oid id;
+	int depth;
+	const char *name;
+	size_t entry; /* + 1, 0 is a free slot */
+};
+
+/* ref of the watched repository, for -w */
+struct refstate {
+	char *name;
+	git_oid id;
+};
+
+/* set of commits with a value each */
+struct oident {
+	git_oid id;
+	long long val;
+	int used;
+};
+
+struct oidset {
+	struct oident *ents;
+	size_t n, cap;
+};
+
+/* commit of the log cache: the rows of the last run, newest first */
+struct cacherow {
+	git_oid id;
+	int hasid;       /* rows of an older cache have no id */
+	const char *row; /* NULL for the newest commit of an older page */
+	size_t rowlen;
+	long long pos;   /* counted from the root */
+};
+
+/* open directory of the file pages */
+struct pagedir {
+	char *path;
+	int fd;
 };
 
 /* reference and associated data for sorting */
@@ -56,9 +195,10 @@ struct referenceinfo {
 	struct commitinfo *ci;
 };
 
-static git_repository *repo;
+/* per thread: each log worker has its own repository handle */
+static _Thread_local git_repository *repo;
 
-static const char *relpath = "";
+static _Thread_local const char *relpath = "";
 static const char *repodir;
 
 static char *name = "";
@@ -70,14 +210,204 @@ static char *licensefiles[] = { "HEAD:LICENSE", "HEAD:LICENSE.md", "HEAD:COPYING
 static char *license;
 static char *readmefiles[] = { "HEAD:README", "HEAD:README.md" };
 static char *readme;
+static git_oid lasthead; /* HEAD of the LICENSE and README of the last run */
+static int probedhead;
 static long long nlogcommits = -1; /* < 0 indicates not used */
-
-/* cache */
-static git_oid lastoid;
-static char lastoidstr[GIT_OID_HEXSZ + 2]; /* id + newline + NUL byte */
-static FILE *rcachefp, *wcachefp;
+static long long logpagesize; /* rows of a log page, 0 for one log.html */
+static long long prioritycommits; /* -n: commit pages written before the backfill */
+static int landing; /* the pass of the landing pages before the backfill */
+static long long nthreads = 1; /* worker threads for the commit and file pages */
+static int useuring; /* write the pages behind with io_uring */
+static int setmtime; /* set the time of the pages to the time of the commit */
+
+/* manifest: a line "status size hash path" per file added (A), changed (M)
+   or removed (D) by this run */
+static const char *manifest;
+static struct obuf wmanifest;
+static pthread_mutex_t manifestlock = PTHREAD_MUTEX_INITIALIZER;
+static git_time_t headtime;
+static long long maxdiff = -1; /* < 0 indicates not used */
+static int verbose;
+static struct allocstats allocstats;
+
+/* limits of the diff shown on a commit page, larger diffs are only counted */
+#define MAXDIFFFILES 1000
+#define MAXDIFFLINES 100000
+
+/* log job queue shared by the log workers, taken LOGBATCH jobs at a time */
+#define LOGBATCH 16
+/* commit pages written by a chunk of the backfill */
+#define BACKFILLCHUNK 256
+static pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logcond = PTHREAD_COND_INITIALIZER;
+static struct logjob *logjobs;
+static size_t nlogjobs, nextlogjob;
+
+/* -b: job server of the processes of the repositories, a pipe with a token
+   for each job. The first worker of a process has the token of the
+   process, the other workers take one for each batch of jobs. */
+static const char *batchfile;
+static int jobpipe[2] = { -1, -1 };
+
+/* cache: a line "id row" per commit of the log, newest first. The log stops
+   at the first commit in the cache: after a rewrite of HEAD the merge-base of
+   both first-parent histories, the cached rows before it are dropped. */
+static char *logcachedata;
+static struct cacherow *cacherows;
+static size_t ncacherows, capcacherows;
+static size_t cachestop; /* first cached row kept */
+static struct oidset cacheids; /* index of the cached row of a commit */
+static FILE *wcachefp;
+
+/* paginated log: the new rows, newest first. The cache has the rows of the
+   newest page of the last run and the newest commit of each older page. */
+static struct obuf logrows;
+static size_t *logrowoffs, nlogrows, caplogrows;
+static git_oid *logrowids;
+static long long nlogcached; /* rows of the last run which are kept */
+static long long nlogpages;  /* pages written by this run */
+
+/* -r: write only the pages of the refs updated by a post-receive hook */
+enum { UPDLOG = 1, UPDREFS = 2, UPDTAGS = 4, UPDREWRITE = 8 };
+static int hook;
+static int updates = UPDLOG | UPDREFS | UPDTAGS;
+static int rewritten; /* the branch of HEAD was rewritten: as with -g */
+
+/* lock of the output directory: byte 0 is locked by the run writing the
+   pages, byte 1 to read or change byte 2, the updates of the runs which
+   found it locked and which it writes next */
+#define LOCKFILE ".stagit.lock"
+static int lockfd = -1;
+
+/* -w: write the updated pages on each change of the refs */
+#define WATCHDELAY 200 /* ms without a change before a run */
+static int watch;
+static char **watchdirs; /* path of the refs directory of a watch */
+static size_t nwatchdirs;
+
+/* -g: remove the pages of commits and files which are not in HEAD */
+static int gc;
+static struct oidset gccommits; /* first-parent history of HEAD */
+static size_t ngcfiles;
+static unsigned long long ngcbytes;
 static const char *cachefile;
 
+/* diffstat store: "stagitds", version and record count, then the records */
+#define STATSMAGIC   "stagitds"
+#define STATSVERSION 1
+#define STATSHDRSIZ  16
+static const char *statsfile;
+static unsigned char *statsmap;
+static size_t statsmaplen, nstats;
+static struct statsrec *newstats;
+static size_t nnewstats, capnewstats;
+
+/* file cache: tree of HEAD and key of the page header of the last run, then
+   a line "lc size path" per file page */
+static const char *filecache;
+static char *fcachedata;
+static struct filerec *fcacherecs;
+static size_t nfcacherecs;
+static git_oid fcachetree;
+static int fcachehastree;
+static int fcachevalid; /* the records match the pages of fcachetree */
+static struct obuf wfcache;
+static char fcachetmp[64] = "files.XXXXXXXXXXXX";
+
+/* file pages of this run by blob id, open addressing */
+static struct blobpage *blobpages;
+static size_t nblobpages, capblobpages;
+static size_t nfileswritten, nfileslinked, nfileskept;
+
+/* entries of the file tree, the pages to write are shared by the workers */
+static pthread_mutex_t filelock = PTHREAD_MUTEX_INITIALIZER;
+static struct fileentry *files;
+static size_t nfiles, capfiles;
+static int filescomplete; /* files has all the entries of the tree of HEAD */
+static size_t *filesbypath; /* entry index + 1 by path, open addressing */
+static size_t capfilesbypath;
+static size_t *filejobs;
+static size_t nfilejobs, nextfilejob;
+#define FILEBATCH 16 /* pages for a token of the job server */
+
+/* open directories of the file pages by path, open addressing */
+#define DIRCACHEMAX 256
+static pthread_mutex_t dirlock = PTHREAD_MUTEX_INITIALIZER;
+static struct pagedir *dirs;
+static size_t ndirs, capdirs;
+
+#define ARENAALIGN 16
+#define ARENAHDR   ((sizeof(struct arenablock) + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1))
+#define ARENABLOCK (64 * 1024)
+
+/* zeroed memory which lives until arena_reset() */
+void *
+arena_alloc(struct arena *a, struct allocstats *st, size_t n)
+{
+	struct arenablock *b = a->blocks;
+	size_t size;
+	char *p;
+
+	n = (n + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+	if (!b || b->size - b->used < n) {
+		size = n > ARENABLOCK ? n : ARENABLOCK;
+		if (!(b = malloc(ARENAHDR + size)))
+			err(1, "malloc");
+		b->size = size;
+		b->used = 0;
+		b->next = a->blocks;
+		a->blocks = b;
+		st->nblocks++;
+	}
+	p = (char *)b + ARENAHDR + b->used;
+	b->used += n;
+	memset(p, 0, n);
+	st->narena++;
+
+	return p;
+}
+
+/* free all allocations, the memory is kept as one block for the next commit */
+void
+arena_reset(struct arena *a, struct allocstats *st)
+{
+	struct arenablock *b, *next;
+	size_t size = 0;
+
+	if (!(b = a->blocks))
+		return;
+	if (!b->next) {
+		b->used = 0;
+		return;
+	}
+	for (; b; b = next) {
+		next = b->next;
+		size += b->size;
+		free(b);
+	}
+	if (!(b = malloc(ARENAHDR + size)))
+		err(1, "malloc");
+	b->size = size;
+	b->used = 0;
+	b->next = NULL;
+	a->blocks = b;
+	st->nblocks++;
+	if (size > st->arenasize)
+		st->arenasize = size;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arenablock *b, *next;
+
+	for (b = a->blocks; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	a->blocks = NULL;
+}
+
 void
 joinpath(char *buf, size_t bufsiz, const char *path, const char *path2)
 {
@@ -90,33 +420,45 @@ joinpath(char *buf, size_t bufsiz, const char *path, const char *path2)
 			path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
 }
 
+/* free the diff and the stats of a commit, for example on an error */
 void
-deltainfo_free(struct deltainfo *di)
+commitinfo_cleardiff(struct commitinfo *ci)
 {
-	if (!di)
-		return;
-	git_patch_free(di->patch);
-	memset(di, 0, sizeof(*di));
-	free(di);
+	git_diff_free(ci->diff);
+	ci->diff = NULL;
+	git_tree_free(ci->commit_tree);
+	ci->commit_tree = NULL;
+	git_tree_free(ci->parent_tree);
+	ci->parent_tree = NULL;
+	git_commit_free(ci->parent);
+	ci->parent = NULL;
+
+	if (!ci->arena)
+		free(ci->deltas);
+	ci->deltas = NULL;
+	ci->ndeltas = 0;
+	free(ci->hunks);
+	ci->hunks = NULL;
+	ci->hunkslen = 0;
+	ci->addcount = 0;
+	ci->delcount = 0;
+	ci->filecount = 0;
 }
 
+/* diff the commit tree against the tree of the first parent */
 int
-commitinfo_getstats(struct commitinfo *ci)
+commitinfo_getdiff(struct commitinfo *ci)
 {
-	struct deltainfo *di;
 	git_diff_options opts;
 	git_diff_find_options fopts;
-	const git_diff_delta *delta;
-	const git_diff_hunk *hunk;
-	const git_diff_line *line;
-	git_patch *patch = NULL;
-	size_t ndeltas, nhunks, nhunklines;
-	size_t i, j, k;
 
-	if (git_tree_lookup(&(ci->commit_tree), repo, git_commit_tree_id(ci->commit)))
-		goto err;
+	/* the tree can be set already, see struct logwindow */
+	if (!ci->commit_tree &&
+	    git_tree_lookup(&(ci->commit_tree), repo, git_commit_tree_id(ci->commit)))
+		return -1;
 	if (!git_commit_parent(&(ci->parent), ci->commit, 0)) {
 		if (git_tree_lookup(&(ci->parent_tree), repo, git_commit_tree_id(ci->parent))) {
+			git_commit_free(ci->parent);
 			ci->parent = NULL;
 			ci->parent_tree = NULL;
 		}
@@ -127,112 +469,55 @@ commitinfo_getstats(struct commitinfo *ci)
 	              GIT_DIFF_IGNORE_SUBMODULES |
 		      GIT_DIFF_INCLUDE_TYPECHANGE;
 	if (git_diff_tree_to_tree(&(ci->diff), repo, ci->parent_tree, ci->commit_tree, &opts))
-		goto err;
+		return -1;
 
 	if (git_diff_find_init_options(&fopts, GIT_DIFF_FIND_OPTIONS_VERSION))
-		goto err;
+		return -1;
 	/* find renames and copies, exact matches (no heuristic) for renames. */
 	fopts.flags |= GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES |
 	               GIT_DIFF_FIND_EXACT_MATCH_ONLY;
 	if (git_diff_find_similar(ci->diff, &fopts))
-		goto err;
-
-	ndeltas = git_diff_num_deltas(ci->diff);
-	if (ndeltas && !(ci->deltas = calloc(ndeltas, sizeof(struct deltainfo *))))
-		err(1, "calloc");
-
-	for (i = 0; i < ndeltas; i++) {
-		if (git_patch_from_diff(&patch, ci->diff, i))
-			goto err;
-
-		if (!(di = calloc(1, sizeof(struct deltainfo))))
-			err(1, "calloc");
-		di->patch = patch;
-		ci->deltas[i] = di;
-
-		delta = git_patch_get_delta(patch);
-
-		/* skip stats for binary data */
-		if (delta->flags & GIT_DIFF_FLAG_BINARY)
-			continue;
-
-		nhunks = git_patch_num_hunks(patch);
-		for (j = 0; j < nhunks; j++) {
-			if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
-				break;
-			for (k = 0; ; k++) {
-				if (git_patch_get_line_in_hunk(&line, patch, j, k))
-					break;
-				if (line->old_lineno == -1) {
-					di->addcount++;
-					ci->addcount++;
-				} else if (line->new_lineno == -1) {
-					di->delcount++;
-					ci->delcount++;
-				}
-			}
-		}
-	}
-	ci->ndeltas = i;
-	ci->filecount = i;
+		return -1;
 
 	return 0;
-
-err:
-	git_diff_free(ci->diff);
-	ci->diff = NULL;
-	git_tree_free(ci->commit_tree);
-	ci->commit_tree = NULL;
-	git_tree_free(ci->parent_tree);
-	ci->parent_tree = NULL;
-	git_commit_free(ci->parent);
-	ci->parent = NULL;
-
-	if (ci->deltas)
-		for (i = 0; i < ci->ndeltas; i++)
-			deltainfo_free(ci->deltas[i]);
-	free(ci->deltas);
-	ci->deltas = NULL;
-	ci->ndeltas = 0;
-	ci->addcount = 0;
-	ci->delcount = 0;
-	ci->filecount = 0;
-
-	return -1;
 }
 
 void
 commitinfo_free(struct commitinfo *ci)
 {
-	size_t i;
-
 	if (!ci)
 		return;
-	if (ci->deltas)
-		for (i = 0; i < ci->ndeltas; i++)
-			deltainfo_free(ci->deltas[i]);
 
-	free(ci->deltas);
+	if (!ci->arena)
+		free(ci->deltas);
+	free(ci->hunks);
 	git_diff_free(ci->diff);
 	git_tree_free(ci->commit_tree);
 	git_tree_free(ci->parent_tree);
 	git_commit_free(ci->commit);
 	git_commit_free(ci->parent);
+	if (ci->arena)
+		return; /* freed on arena_reset() */
 	memset(ci, 0, sizeof(*ci));
 	free(ci);
 }
 
+/* commit info of a parsed commit, the commit is owned by the commit info.
+   The commit info is allocated from the arena of the log context lc if set. */
 struct commitinfo *
-commitinfo_getbyoid(const git_oid *id)
+commitinfo_getbycommit(git_commit *commit, struct logctx *lc)
 {
 	struct commitinfo *ci;
 
-	if (!(ci = calloc(1, sizeof(struct commitinfo))))
+	if (lc) {
+		ci = arena_alloc(&(lc->arena), &(lc->stats), sizeof(struct commitinfo));
+		ci->arena = &(lc->arena);
+	} else if (!(ci = calloc(1, sizeof(struct commitinfo)))) {
 		err(1, "calloc");
+	}
 
-	if (git_commit_lookup(&(ci->commit), repo, id))
-		goto err;
-	ci->id = id;
+	ci->commit = commit;
+	ci->id = git_commit_id(ci->commit);
 
 	git_oid_tostr(ci->oid, sizeof(ci->oid), git_commit_id(ci->commit));
 	git_oid_tostr(ci->parentoid, sizeof(ci->parentoid), git_commit_parent_id(ci->commit, 0));
@@ -243,11 +528,185 @@ commitinfo_getbyoid(const git_oid *id)
 	ci->msg = git_commit_message(ci->commit);
 
 	return ci;
+}
 
-err:
-	commitinfo_free(ci);
+struct commitinfo *
+commitinfo_getbyoid(const git_oid *id, struct logctx *lc)
+{
+	git_commit *commit;
 
-	return NULL;
+	if (git_commit_lookup(&commit, repo, id))
+		return NULL;
+
+	return commitinfo_getbycommit(commit, lc);
+}
+
+uint32_t
+getbe32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+void
+putbe32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+int
+statsrec_cmp(const void *v1, const void *v2)
+{
+	return memcmp(v1, v2, GIT_OID_RAWSZ);
+}
+
+/* map the diffstat store (does not need to exist) */
+void
+statsload(void)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(statsfile, O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return;
+		err(1, "open: '%s'", statsfile);
+	}
+	if (fstat(fd, &st) == -1)
+		err(1, "fstat: '%s'", statsfile);
+	/* an empty file is an empty store, for example made with touch */
+	if (st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	if (st.st_size < STATSHDRSIZ)
+		errx(1, "%s: invalid stats file", statsfile);
+
+	statsmaplen = st.st_size;
+	statsmap = mmap(NULL, statsmaplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (statsmap == MAP_FAILED)
+		err(1, "mmap: '%s'", statsfile);
+	close(fd);
+
+	if (memcmp(statsmap, STATSMAGIC, 8) ||
+	    getbe32(statsmap + 8) != STATSVERSION)
+		errx(1, "%s: invalid stats file", statsfile);
+	nstats = getbe32(statsmap + 12);
+	if (statsmaplen != STATSHDRSIZ + nstats * sizeof(struct statsrec))
+		errx(1, "%s: invalid stats file", statsfile);
+}
+
+/* get the diffstat of a commit from the store, returns -1 if not found */
+int
+statsget(struct commitinfo *ci)
+{
+	struct statsrec *sr;
+
+	if (!nstats)
+		return -1;
+	if (!(sr = bsearch(git_commit_id(ci->commit)->id,
+	                   statsmap + STATSHDRSIZ, nstats,
+	                   sizeof(struct statsrec), statsrec_cmp)))
+		return -1;
+
+	ci->filecount = getbe32(sr->filecount);
+	ci->addcount = getbe32(sr->addcount);
+	ci->delcount = getbe32(sr->delcount);
+
+	return 0;
+}
+
+void
+statsadd(const git_oid *id, size_t filecount, size_t addcount, size_t delcount)
+{
+	struct statsrec *sr;
+
+	/* does not fit the record, it is calculated again next time */
+	if (filecount > UINT32_MAX || addcount > UINT32_MAX ||
+	    delcount > UINT32_MAX)
+		return;
+
+	if (nnewstats == capnewstats) {
+		capnewstats = capnewstats ? capnewstats * 2 : 1024;
+		if (!(newstats = reallocarray(newstats, capnewstats, sizeof(*newstats))))
+			err(1, "realloc");
+	}
+	sr = &newstats[nnewstats++];
+	memcpy(sr->oid, id->id, sizeof(sr->oid));
+	putbe32(sr->filecount, filecount);
+	putbe32(sr->addcount, addcount);
+	putbe32(sr->delcount, delcount);
+}
+
+/* merge the new records into the store */
+void
+statswrite(void)
+{
+	const struct statsrec *old;
+	unsigned char hdr[STATSHDRSIZ];
+	char tmppath[64] = "stats.XXXXXXXXXXXX";
+	size_t i, j, n;
+	mode_t mask;
+	FILE *fp;
+	int fd;
+
+	if (!nnewstats)
+		return;
+	qsort(newstats, nnewstats, sizeof(*newstats), statsrec_cmp);
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	/* header is written when the number of records is known */
+	memset(hdr, 0, sizeof(hdr));
+	fwrite(hdr, 1, sizeof(hdr), fp);
+
+	old = statsmap ? (const struct statsrec *)(statsmap + STATSHDRSIZ) : NULL;
+	for (i = j = n = 0; i < nstats || j < nnewstats; n++) {
+		if (j >= nnewstats ||
+		    (i < nstats && statsrec_cmp(&old[i], &newstats[j]) <= 0)) {
+			if (j < nnewstats && !statsrec_cmp(&old[i], &newstats[j]))
+				j++;
+			fwrite(&old[i++], 1, sizeof(*old), fp);
+		} else {
+			fwrite(&newstats[j++], 1, sizeof(*newstats), fp);
+		}
+	}
+	if (n > UINT32_MAX)
+		errx(1, "%s: too many records", statsfile);
+	memcpy(hdr, STATSMAGIC, 8);
+	putbe32(hdr + 8, STATSVERSION);
+	putbe32(hdr + 12, n);
+	if (fseek(fp, 0, SEEK_SET) == -1)
+		err(1, "fseek: '%s'", tmppath);
+	fwrite(hdr, 1, sizeof(hdr), fp);
+	if (fflush(fp) || ferror(fp))
+		err(1, "fwrite: '%s'", tmppath);
+	fclose(fp);
+
+	if (rename(tmppath, statsfile))
+		err(1, "rename: '%s' to '%s'", tmppath, statsfile);
+	umask((mask = umask(0)));
+	if (chmod(statsfile,
+	    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+		err(1, "chmod: '%s'", statsfile);
+}
+
+/* merge the new records and map the store again, for the next chunk */
+void
+statsflush(void)
+{
+	statswrite();
+	if (statsmap)
+		munmap(statsmap, statsmaplen);
+	statsmap = NULL;
+	statsmaplen = nstats = 0;
+	nnewstats = 0;
+	statsload();
 }
 
 int
@@ -311,7 +770,7 @@ getrefs(struct referenceinfo **pris, size_t *prefcount)
 			goto err;
 		if (!(id = git_object_id(obj)))
 			goto err;
-		if (!(ci = commitinfo_getbyoid(id)))
+		if (!(ci = commitinfo_getbyoid(id, NULL)))
 			break;
 
 		if (!(ris = reallocarray(ris, refcount + 1, sizeof(*ris))))
@@ -348,163 +807,114 @@ err:
 	return -1;
 }
 
-FILE *
-efopen(const char *name, const char *flags)
-{
-	FILE *fp;
-
-	if (!(fp = fopen(name, flags)))
-		err(1, "fopen: '%s'", name);
-
-	return fp;
-}
-
-/* Escape characters below as HTML 2.0 / XML 1.0. */
-void
-xmlencode(FILE *fp, const char *s, size_t len)
-{
-	size_t i;
-
-	for (i = 0; *s && i < len; s++, i++) {
-		switch(*s) {
-		case '<':  fputs("&lt;",   fp); break;
-		case '>':  fputs("&gt;",   fp); break;
-		case '\'': fputs("&#39;",  fp); break;
-		case '&':  fputs("&amp;",  fp); break;
-		case '"':  fputs("&quot;", fp); break;
-		default:   fputc(*s, fp);
-		}
-	}
-}
-
-int
-mkdirp(const char *path)
-{
-	char tmp[PATH_MAX], *p;
-
-	if (strlcpy(tmp, path, sizeof(tmp)) >= sizeof(tmp))
-		errx(1, "path truncated: '%s'", path);
-	for (p = tmp + (tmp[0] == '/'); *p; p++) {
-		if (*p != '/')
-			continue;
-		*p = '\0';
-		if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
-			return -1;
-		*p = '/';
-	}
-	if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
-		return -1;
-	return 0;
-}
-
 void
-printtimez(FILE *fp, const git_time *intime)
+printtimez(struct obuf *ob, const git_time *intime)
 {
-	struct tm *intm;
+	struct tm tm, *intm;
 	time_t t;
 	char out[32];
 
 	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
+	if (!(intm = gmtime_r(&t, &tm)))
 		return;
 	strftime(out, sizeof(out), "%Y-%m-%dT%H:%M:%SZ", intm);
-	fputs(out, fp);
+	bputs(ob, out);
 }
 
 void
-printtime(FILE *fp, const git_time *intime)
+printtime(struct obuf *ob, const git_time *intime)
 {
-	struct tm *intm;
+	struct tm tm, *intm;
 	time_t t;
 	char out[32];
 
 	t = (time_t)intime->time + (intime->offset * 60);
-	if (!(intm = gmtime(&t)))
+	if (!(intm = gmtime_r(&t, &tm)))
 		return;
 	strftime(out, sizeof(out), "%a, %e %b %Y %H:%M:%S", intm);
 	if (intime->offset < 0)
-		fprintf(fp, "%s -%02d%02d", out,
+		bprintf(ob, "%s -%02d%02d", out,
 		            -(intime->offset) / 60, -(intime->offset) % 60);
 	else
-		fprintf(fp, "%s +%02d%02d", out,
+		bprintf(ob, "%s +%02d%02d", out,
 		            intime->offset / 60, intime->offset % 60);
 }
 
 void
-printtimeshort(FILE *fp, const git_time *intime)
+printtimeshort(struct obuf *ob, const git_time *intime)
 {
-	struct tm *intm;
+	struct tm tm, *intm;
 	time_t t;
 	char out[32];
 
 	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
+	if (!(intm = gmtime_r(&t, &tm)))
 		return;
 	strftime(out, sizeof(out), "%Y-%m-%d %H:%M", intm);
-	fputs(out, fp);
+	bputs(ob, out);
 }
 
 void
-writeheader(FILE *fp, const char *title)
+writeheader(struct obuf *ob, const char *title)
 {
-	fputs("<!DOCTYPE html>\n"
+	bputs(ob, "<!DOCTYPE html>\n"
 		"<html>\n<head>\n"
 		"<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
 		"<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\" />\n"
-		"<title>", fp);
-	xmlencode(fp, title, strlen(title));
+		"<title>");
+	xmlencode(ob, title, strlen(title));
 	if (title[0] && strippedname[0])
-		fputs(" - ", fp);
-	xmlencode(fp, strippedname, strlen(strippedname));
+		bputs(ob, " - ");
+	xmlencode(ob, strippedname, strlen(strippedname));
 	if (description[0])
-		fputs(" - ", fp);
-	xmlencode(fp, description, strlen(description));
+		bputs(ob, " - ");
+	xmlencode(ob, description, strlen(description));
 	/* Asset files are in parent directory */
-	fputs("</title>\n", fp);
-	fprintf(fp, "<link rel=\"icon\" type=\"image/png\" href=\"%s../favicon.png\" />\n", relpath);
-	fprintf(fp, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed\" href=\"%satom.xml\" />\n",
+	bputs(ob, "</title>\n");
+	bprintf(ob, "<link rel=\"icon\" type=\"image/png\" href=\"%s../favicon.png\" />\n", relpath);
+	bprintf(ob, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed\" href=\"%satom.xml\" />\n",
 		name, relpath);
-	fprintf(fp, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed (tags)\" href=\"%stags.xml\" />\n",
+	bprintf(ob, "<link rel=\"alternate\" type=\"application/atom+xml\" title=\"%s Atom Feed (tags)\" href=\"%stags.xml\" />\n",
 		name, relpath);
-	fprintf(fp, "<link rel=\"stylesheet\" type=\"text/css\" href=\"%s../style.css\" />\n", relpath);
+	bprintf(ob, "<link rel=\"stylesheet\" type=\"text/css\" href=\"%s../style.css\" />\n", relpath);
 	/* highlight.js for syntax highlighting */
-	fputs("<link rel=\"stylesheet\" href=\"https://cdnjs.cloudflare.com/ajax/libs/highlight.js/11.9.0/styles/github.min.css\" media=\"(prefers-color-scheme: light)\" />\n", fp);
-	fputs("<link rel=\"stylesheet\" href=\"https://cdnjs.cloudflare.com/ajax/libs/highlight.js/11.9.0/styles/github-dark.min.css\" media=\"(prefers-color-scheme: dark)\" />\n", fp);
-	fputs("<script src=\"https://cdnjs.cloudflare.com/ajax/libs/highlight.js/11.9.0/highlight.min.js\"></script>\n", fp);
-	fputs("</head>\n<body>\n", fp);
+	bputs(ob, "<link rel=\"stylesheet\" href=\"https://cdnjs.cloudflare.com/ajax/libs/highlight.js/11.9.0/styles/github.min.css\" media=\"(prefers-color-scheme: light)\" />\n");
+	bputs(ob, "<link rel=\"stylesheet\" href=\"https://cdnjs.cloudflare.com/ajax/libs/highlight.js/11.9.0/styles/github-dark.min.css\" media=\"(prefers-color-scheme: dark)\" />\n");
+	bputs(ob, "<script src=\"https://cdnjs.cloudflare.com/ajax/libs/highlight.js/11.9.0/highlight.min.js\"></script>\n");
+	bputs(ob, "</head>\n<body>\n");
 	
 	/* Theme toggle button */
-	fputs("<button id=\"theme-toggle\" aria-label=\"Toggle dark mode\" title=\"Toggle theme\">🌓</button>\n", fp);
+	bputs(ob, "<button id=\"theme-toggle\" aria-label=\"Toggle dark mode\" title=\"Toggle theme\">🌓</button>\n");
 	
 	/* Header */
-	fputs("<header class=\"repo-header\"><div class=\"container\">\n", fp);
-	fputs("<div class=\"repo-title\">", fp);
-	fprintf(fp, "<a href=\"%s../index.html\"><img src=\"%s../logo.png\" alt=\"\" width=\"24\" height=\"24\" /></a>",
+	bputs(ob, "<header class=\"repo-header\"><div class=\"container\">\n");
+	bputs(ob, "<div class=\"repo-title\">");
+	bprintf(ob, "<a href=\"%s../index.html\"><img src=\"%s../logo.png\" alt=\"\" width=\"24\" height=\"24\" /></a>",
 	        relpath, relpath);
-	fputs("<h1>", fp);
-	xmlencode(fp, strippedname, strlen(strippedname));
-	fputs("</h1>", fp);
+	bputs(ob, "<h1>");
+	xmlencode(ob, strippedname, strlen(strippedname));
+	bputs(ob, "</h1>");
 	if (description[0]) {
-		fputs("<span class=\"desc\">", fp);
-		xmlencode(fp, description, strlen(description));
-		fputs("</span>", fp);
+		bputs(ob, "<span class=\"desc\">");
+		xmlencode(ob, description, strlen(description));
+		bputs(ob, "</span>");
 	}
-	fputs("</div>\n", fp);
+	bputs(ob, "</div>\n");
 
 	if (cloneurl[0]) {
-		fputs("<div class=\"url\" style=\"margin: 12px 0;\">", fp);
-		fputs("<input id=\"clone-url\" class=\"clone-url\" type=\"text\" readonly value=\"git clone ", fp);
-		xmlencode(fp, cloneurl, strlen(cloneurl));
-		fputs("\" /> ", fp);
-		fputs("<button id=\"copy-btn\" class=\"copy-btn\" type=\"button\" aria-label=\"Copy clone URL\">Copy</button>", fp);
-		fputs("</div>\n", fp);
+		bputs(ob, "<div class=\"url\" style=\"margin: 12px 0;\">");
+		bputs(ob, "<input id=\"clone-url\" class=\"clone-url\" type=\"text\" readonly value=\"git clone ");
+		xmlencode(ob, cloneurl, strlen(cloneurl));
+		bputs(ob, "\" /> ");
+		bputs(ob, "<button id=\"copy-btn\" class=\"copy-btn\" type=\"button\" aria-label=\"Copy clone URL\">Copy</button>");
+		bputs(ob, "</div>\n");
 	}
 
 	/* Navigation */
-	fputs("<nav class=\"nav\"><ul class=\"nav__list\">\n", fp);
+	bputs(ob, "<nav class=\"nav\"><ul class=\"nav__list\">\n");
 
 	/* Log */
-	fprintf(fp,
+	bprintf(ob,
 	"<li class=\"nav__item\"><a class=\"nav__link\" href=\"%slog.html\">"
 	"<svg class=\"nav__icon\" width=\"16\" height=\"16\" viewBox=\"0 0 24 24\" aria-hidden=\"true\" role=\"img\" fill=\"currentColor\">"
 		"<path d=\"M12 1.75a10.25 10.25 0 1 0 0 20.5 10.25 10.25 0 0 0 0-20.5Zm0 1.5a8.75 8.75 0 1 1 0 17.5 8.75 8.75 0 0 1 0-17.5Zm-.75 3.75a.75.75 0 0 1 1.5 0v5.19l3.22 1.86a.75.75 0 0 1-.75 1.3l-3.72-2.15a.75.75 0 0 1-.37-.65V7z\"/>"
@@ -512,7 +922,7 @@ writeheader(FILE *fp, const char *title)
 	"<span class=\"nav__text\">Log</span></a></li>\n", relpath);
 
 	/* Files */
-	fprintf(fp,
+	bprintf(ob,
 	"<li class=\"nav__item\"><a class=\"nav__link\" href=\"%sfiles.html\">"
 	"<svg class=\"nav__icon\" width=\"16\" height=\"16\" viewBox=\"0 0 24 24\" aria-hidden=\"true\" role=\"img\" fill=\"currentColor\">"
 		"<path d=\"M4 5.5A1.5 1.5 0 0 1 5.5 4h4.38c.4 0 .78.16 1.06.44l1.12 1.12c.28.28.66.44 1.06.44H18.5A1.5 1.5 0 0 1 20 7.5v10A2.5 2.5 0 0 1 17.5 20h-11A2.5 2.5 0 0 1 4 17.5v-12Z\"/>"
@@ -520,7 +930,7 @@ writeheader(FILE *fp, const char *title)
 	"<span class=\"nav__text\">Files</span></a></li>\n", relpath);
 
 	/* Refs */
-	fprintf(fp,
+	bprintf(ob,
 	"<li class=\"nav__item\"><a class=\"nav__link\" href=\"%srefs.html\">"
 	"<svg class=\"nav__icon\" width=\"16\" height=\"16\" viewBox=\"0 0 24 24\" aria-hidden=\"true\" role=\"img\" fill=\"currentColor\">"
 		"<path d=\"M7 4.5A2.5 2.5 0 1 1 7 9.5 2.5 2.5 0 0 1 7 4.5Zm0 1.5a1 1 0 1 0 0 2 1 1 0 0 0 0-2Zm2 4.75h6.19l-2.22-2.22a.75.75 0 0 1 1.06-1.06l3.5 3.5a.75.75 0 0 1 0 1.06l-3.5 3.5a.75.75 0 1 1-1.06-1.06l2.22-2.22H9a2 2 0 0 0-2 2V19a.75.75 0 0 1-1.5 0v-6a3.5 3.5 0 0 1 3.5-3.5Z\"/>"
@@ -529,7 +939,7 @@ writeheader(FILE *fp, const char *title)
 
 	/* Submodules（存在する場合のみ） */
 	if (submodules)
-	fprintf(fp,
+	bprintf(ob,
 		"<li class=\"nav__item\"><a class=\"nav__link\" href=\"%sfile/%s.html\">"
 		"<svg class=\"nav__icon\" width=\"16\" height=\"16\" viewBox=\"0 0 24 24\" aria-hidden=\"true\" role=\"img\" fill=\"currentColor\">"
 		"<path d=\"M4.5 7A2.5 2.5 0 0 1 7 4.5h10A2.5 2.5 0 0 1 19.5 7v10A2.5 2.5 0 0 1 17 19.5H7A2.5 2.5 0 0 1 4.5 17V7Zm3 1.5h9v7h-9v-7Zm-1.5 0v7A1 1 0 0 0 7 16.5h.5v-9H7A1 1 0 0 0 6 8.5Z\"/>"
@@ -538,7 +948,7 @@ writeheader(FILE *fp, const char *title)
 
 	/* README（存在する場合のみ） */
 	if (readme)
-	fprintf(fp,
+	bprintf(ob,
 		"<li class=\"nav__item\"><a class=\"nav__link\" href=\"%sfile/%s.html\">"
 		"<svg class=\"nav__icon\" width=\"16\" height=\"16\" viewBox=\"0 0 24 24\" aria-hidden=\"true\" role=\"img\" fill=\"currentColor\">"
 		"<path d=\"M6.5 4A2.5 2.5 0 0 0 4 6.5v11A2.5 2.5 0 0 0 6.5 20h9A2.5 2.5 0 0 0 18 17.5v-11A2.5 2.5 0 0 0 15.5 4h-9Zm0 1.5h9A1 1 0 0 1 16.5 6.5v9.25c-.55-.3-1.2-.5-2-.5H7a3.5 3.5 0 0 0-2 .5V6.5A1 1 0 0 1 6.5 5.5Z\"/>"
@@ -547,28 +957,28 @@ writeheader(FILE *fp, const char *title)
 
 	/* LICENSE（存在する場合のみ） */
 	if (license)
-	fprintf(fp,
+	bprintf(ob,
 		"<li class=\"nav__item\"><a class=\"nav__link\" href=\"%sfile/%s.html\">"
 		"<svg class=\"nav__icon\" width=\"16\" height=\"16\" viewBox=\"0 0 24 24\" aria-hidden=\"true\" role=\"img\" fill=\"currentColor\">"
 		"<path d=\"M12 2a6 6 0 0 1 6 6v4.59l1.3 1.3a1 1 0 0 1-1.41 1.41l-.89-.9A6.97 6.97 0 0 1 12 17a6.97 6.97 0 0 1-5-2.2l-.89.9a1 1 0 1 1-1.41-1.41L6 12.59V8a6 6 0 0 1 6-6Zm0 2A4 4 0 0 0 8 8v5.17A4.97 4.97 0 0 0 12 15c1.93 0 3.65-.55 5-1.83V8a4 4 0 0 0-4-4Z\"/>"
 		"</svg>"
 		"<span class=\"nav__text\">LICENSE</span></a></li>\n", relpath, license);
 
-	fputs("</ul></nav>\n", fp);
-	fputs("</div></header>\n", fp);
+	bputs(ob, "</ul></nav>\n");
+	bputs(ob, "</div></header>\n");
 	
 	/* Breadcrumb navigation */
-	fputs("<nav aria-label=\"Breadcrumb\" class=\"container\" style=\"padding-top:16px;\">\n", fp);
-	fputs("<ol class=\"breadcrumb\">\n", fp);
-	fprintf(fp, "<li><a href=\"%s../index.html\">Home</a></li>\n", relpath);
-	fputs("<li><span id=\"breadcrumb-page\"></span></li>\n", fp);
-	fputs("</ol>\n</nav>\n", fp);
+	bputs(ob, "<nav aria-label=\"Breadcrumb\" class=\"container\" style=\"padding-top:16px;\">\n");
+	bputs(ob, "<ol class=\"breadcrumb\">\n");
+	bprintf(ob, "<li><a href=\"%s../index.html\">Home</a></li>\n", relpath);
+	bputs(ob, "<li><span id=\"breadcrumb-page\"></span></li>\n");
+	bputs(ob, "</ol>\n</nav>\n");
 	
 	/* Main content wrapper */
-	fputs("<main><div id=\"content\" class=\"container\">\n", fp);
+	bputs(ob, "<main><div id=\"content\" class=\"container\">\n");
 	
 	/* JavaScript for theme toggle and clipboard */
-	fputs("<script>\n"
+	bputs(ob, "<script>\n"
 		"/* Theme toggle */\n"
 		"(function(){\n"
 		"  var toggle=document.getElementById('theme-toggle');\n"
@@ -622,25 +1032,25 @@ writeheader(FILE *fp, const char *title)
 		"})();\n"
 		"/* highlight.js initialization */\n"
 		"if(typeof hljs!=='undefined'){hljs.highlightAll();}\n"
-		"</script>\n", fp);
+		"</script>\n");
 }
 
 void
-writefooter(FILE *fp)
+writefooter(struct obuf *ob)
 {
-	fputs("</div></main>\n</body>\n</html>\n", fp);
+	bputs(ob, "</div></main>\n</body>\n</html>\n");
 }
 
 void
-printfileicon(FILE *fp, const char *filename, int isdir)
+printfileicon(struct obuf *ob, const char *filename, int isdir)
 {
 	const char *ext;
 	
 	if (isdir) {
 		/* Directory icon */
-		fputs("<svg class=\"file-icon file-icon-dir\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
+		bputs(ob, "<svg class=\"file-icon file-icon-dir\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
 			"<path d=\"M1.75 1A1.75 1.75 0 0 0 0 2.75v10.5C0 14.216.784 15 1.75 15h12.5A1.75 1.75 0 0 0 16 13.25v-8.5A1.75 1.75 0 0 0 14.25 3H7.5a.25.25 0 0 1-.2-.1l-.9-1.2C6.07 1.26 5.55 1 5 1H1.75Z\"></path>"
-			"</svg>", fp);
+			"</svg>");
 		return;
 	}
 	
@@ -655,48 +1065,60 @@ printfileicon(FILE *fp, const char *filename, int isdir)
 		    !strcasecmp(ext, "py") || !strcasecmp(ext, "js") ||
 		    !strcasecmp(ext, "ts") || !strcasecmp(ext, "go") ||
 		    !strcasecmp(ext, "rs") || !strcasecmp(ext, "rb")) {
-			fputs("<svg class=\"file-icon\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
+			bputs(ob, "<svg class=\"file-icon\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
 				"<path d=\"M4 1.75C4 .784 4.784 0 5.75 0h5.586c.464 0 .909.184 1.237.513l2.914 2.914c.329.328.513.773.513 1.237v8.586A1.75 1.75 0 0 1 14.25 15h-9a.75.75 0 0 1 0-1.5h9a.25.25 0 0 0 .25-.25V6h-2.75A1.75 1.75 0 0 1 10 4.25V1.5H5.75a.25.25 0 0 0-.25.25v2.5a.75.75 0 0 1-1.5 0V1.75Zm-1 10.5a.75.75 0 0 1 .75-.75h.5a.75.75 0 0 1 0 1.5h-.5a.75.75 0 0 1-.75-.75Zm3.75-.75a.75.75 0 0 0 0 1.5h.5a.75.75 0 0 0 0-1.5h-.5Z\"></path>"
-				"</svg>", fp);
+				"</svg>");
 		/* Markdown */
 		} else if (!strcasecmp(ext, "md") || !strcasecmp(ext, "markdown")) {
-			fputs("<svg class=\"file-icon\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
+			bputs(ob, "<svg class=\"file-icon\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
 				"<path d=\"M14.85 3c.63 0 1.15.52 1.14 1.15v7.7c0 .63-.51 1.15-1.15 1.15H1.15C.52 13 0 12.48 0 11.84V4.15C0 3.52.52 3 1.15 3ZM9 11V5H7L5.5 7 4 5H2v6h2V8l1.5 1.92L7 8v3Zm2.99.5L14.5 8H13V5h-2v3H9.5Z\"></path>"
-				"</svg>", fp);
+				"</svg>");
 		/* Config files */
 		} else if (!strcasecmp(ext, "json") || !strcasecmp(ext, "xml") ||
 		           !strcasecmp(ext, "yaml") || !strcasecmp(ext, "yml") ||
 		           !strcasecmp(ext, "toml") || !strcasecmp(ext, "conf") ||
 		           !strcasecmp(ext, "cfg") || !strcasecmp(ext, "ini")) {
-			fputs("<svg class=\"file-icon\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
+			bputs(ob, "<svg class=\"file-icon\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
 				"<path d=\"M9.5 1.25a3.25 3.25 0 1 1 4.22 3.1c.14.155.28.347.395.562.113.214.2.488.254.782.09.49.09 1.066.09 1.681V9.5a.75.75 0 0 1-1.5 0V7.375c0-.676 0-1.163-.08-1.565a2.583 2.583 0 0 0-.17-.522 1.78 1.78 0 0 0-.248-.363A3.25 3.25 0 0 1 9.5 1.25ZM6.25 4a3.25 3.25 0 0 0-3.226 3.575.75.75 0 0 1-1.476.236A4.75 4.75 0 0 1 6.25 2.5h.5a.75.75 0 0 1 0 1.5h-.5Z\"></path>"
-				"</svg>", fp);
+				"</svg>");
 		/* Images */
 		} else if (!strcasecmp(ext, "png") || !strcasecmp(ext, "jpg") ||
 		           !strcasecmp(ext, "jpeg") || !strcasecmp(ext, "gif") ||
 		           !strcasecmp(ext, "svg") || !strcasecmp(ext, "webp")) {
-			fputs("<svg class=\"file-icon\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
+			bputs(ob, "<svg class=\"file-icon\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
 				"<path d=\"M16 13.25A1.75 1.75 0 0 1 14.25 15H1.75A1.75 1.75 0 0 1 0 13.25V2.75C0 1.784.784 1 1.75 1h12.5c.966 0 1.75.784 1.75 1.75ZM1.75 2.5a.25.25 0 0 0-.25.25v10.5c0 .138.112.25.25.25h.94l.03-.03 6.077-6.078a1.75 1.75 0 0 1 2.412-.06L14.5 10.31V2.75a.25.25 0 0 0-.25-.25Z\"></path>"
-				"</svg>", fp);
+				"</svg>");
 		} else {
 			/* Default file icon */
-			fputs("<svg class=\"file-icon file-icon-file\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
+			bputs(ob, "<svg class=\"file-icon file-icon-file\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
 				"<path d=\"M2 1.75C2 .784 2.784 0 3.75 0h6.586c.464 0 .909.184 1.237.513l2.914 2.914c.329.328.513.773.513 1.237v9.586A1.75 1.75 0 0 1 13.25 16h-9.5A1.75 1.75 0 0 1 2 14.25Zm1.75-.25a.25.25 0 0 0-.25.25v12.5c0 .138.112.25.25.25h9.5a.25.25 0 0 0 .25-.25V6h-2.75A1.75 1.75 0 0 1 9 4.25V1.5Zm6.75.062V4.25c0 .138.112.25.25.25h2.688l-.011-.013-2.914-2.914-.013-.011Z\"></path>"
-				"</svg>", fp);
+				"</svg>");
 		}
 	} else {
 		/* Default file icon (no extension) */
-		fputs("<svg class=\"file-icon file-icon-file\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
+		bputs(ob, "<svg class=\"file-icon file-icon-file\" width=\"16\" height=\"16\" viewBox=\"0 0 16 16\" fill=\"currentColor\">"
 			"<path d=\"M2 1.75C2 .784 2.784 0 3.75 0h6.586c.464 0 .909.184 1.237.513l2.914 2.914c.329.328.513.773.513 1.237v9.586A1.75 1.75 0 0 1 13.25 16h-9.5A1.75 1.75 0 0 1 2 14.25Zm1.75-.25a.25.25 0 0 0-.25.25v12.5c0 .138.112.25.25.25h9.5a.25.25 0 0 0 .25-.25V6h-2.75A1.75 1.75 0 0 1 9 4.25V1.5Zm6.75.062V4.25c0 .138.112.25.25.25h2.688l-.011-.013-2.914-2.914-.013-.011Z\"></path>"
-			"</svg>", fp);
+			"</svg>");
 	}
 }
 
+/* line number anchor of a blob line */
+void
+printlineno(struct obuf *ob, size_t n)
+{
+	bputs(ob, "<a href=\"#l");
+	bputnum(ob, n, 0);
+	bputs(ob, "\" class=\"line\" id=\"l");
+	bputnum(ob, n, 0);
+	bputs(ob, "\">");
+	bputnum(ob, n, 7);
+	bputs(ob, "</a> ");
+}
+
 int
-writeblobhtml(FILE *fp, const git_blob *blob, const char *filename)
+writeblobhtml(struct obuf *ob, const git_blob *blob, const char *filename)
 {
 	size_t n = 0, i, prev;
-	const char *nfmt = "<a href=\"#l%d\" class=\"line\" id=\"l%d\">%7d</a> ";
 	const char *s = git_blob_rawcontent(blob);
 	git_off_t len = git_blob_rawsize(blob);
 	const char *ext, *lang = "";
@@ -723,113 +1145,305 @@ writeblobhtml(FILE *fp, const git_blob *blob, const char *filename)
 		else if (!strcasecmp(ext, "md") || !strcasecmp(ext, "markdown")) lang = "language-markdown";
 	}
 
-	fprintf(fp, "<pre id=\"blob\"><code class=\"%s\">\n", lang);
+	bprintf(ob, "<pre id=\"blob\"><code class=\"%s\">\n", lang);
 
 	if (len > 0) {
 		for (i = 0, prev = 0; i < (size_t)len; i++) {
 			if (s[i] != '\n')
 				continue;
 			n++;
-			fprintf(fp, nfmt, n, n, n);
-			xmlencode(fp, &s[prev], i - prev + 1);
+			printlineno(ob, n);
+			xmlencode(ob, &s[prev], i - prev + 1);
 			prev = i + 1;
 		}
 		/* trailing data */
 		if ((len - prev) > 0) {
 			n++;
-			fprintf(fp, nfmt, n, n, n);
-			xmlencode(fp, &s[prev], len - prev);
+			printlineno(ob, n);
+			xmlencode(ob, &s[prev], len - prev);
 		}
 	}
 
-	fputs("</code></pre>\n", fp);
+	bputs(ob, "</code></pre>\n");
 
 	return n;
 }
 
 void
-printcommit(FILE *fp, struct commitinfo *ci)
+printcommit(struct obuf *ob, struct commitinfo *ci)
 {
-	fprintf(fp, "<b>commit</b> <a href=\"%scommit/%s.html\">%s</a>\n",
+	bprintf(ob, "<b>commit</b> <a href=\"%scommit/%s.html\">%s</a>\n",
 		relpath, ci->oid, ci->oid);
 
 	if (ci->parentoid[0])
-		fprintf(fp, "<b>parent</b> <a href=\"%scommit/%s.html\">%s</a>\n",
+		bprintf(ob, "<b>parent</b> <a href=\"%scommit/%s.html\">%s</a>\n",
 			relpath, ci->parentoid, ci->parentoid);
 
 	if (ci->author) {
-		fputs("<b>Author:</b> ", fp);
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs(" &lt;<a href=\"mailto:", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("\">", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("</a>&gt;\n<b>Date:</b>   ", fp);
-		printtime(fp, &(ci->author->when));
-		fputc('\n', fp);
+		bputs(ob, "<b>Author:</b> ");
+		xmlencode(ob, ci->author->name, strlen(ci->author->name));
+		bputs(ob, " &lt;<a href=\"mailto:");
+		xmlencode(ob, ci->author->email, strlen(ci->author->email));
+		bputs(ob, "\">");
+		xmlencode(ob, ci->author->email, strlen(ci->author->email));
+		bputs(ob, "</a>&gt;\n<b>Date:</b>   ");
+		printtime(ob, &(ci->author->when));
+		bputc(ob, '\n');
 	}
 	if (ci->msg) {
-		fputc('\n', fp);
-		xmlencode(fp, ci->msg, strlen(ci->msg));
-		fputc('\n', fp);
+		bputc(ob, '\n');
+		xmlencode(ob, ci->msg, strlen(ci->msg));
+		bputc(ob, '\n');
 	}
 }
 
+/* anchor of a delta, hunk or changed line of the diff: h<i>[-<j>[-<k>]] */
 void
-printshowfile(FILE *fp, struct commitinfo *ci)
+printdiffid(struct obuf *ob, const size_t *ids, size_t n)
 {
-	const git_diff_delta *delta;
-	const git_diff_hunk *hunk;
-	const git_diff_line *line;
-	git_patch *patch;
-	size_t nhunks, nhunklines, changed, add, del, total, i, j, k;
-	char linestr[80];
-	int c;
-
-	printcommit(fp, ci);
-
-	if (!ci->deltas)
-		return;
+	size_t i;
 
-	if (ci->filecount > 1000   ||
-	    ci->ndeltas   > 1000   ||
-	    ci->addcount  > 100000 ||
-	    ci->delcount  > 100000) {
-		fputs("Diff is too large, output suppressed.\n", fp);
-		return;
+	bputc(ob, 'h');
+	for (i = 0; i < n; i++) {
+		if (i)
+			bputc(ob, '-');
+		bputnum(ob, ids[i], 0);
 	}
+}
 
-	/* diff stat */
-	fputs("<b>Diffstat:</b>\n<table>", fp);
-	for (i = 0; i < ci->ndeltas; i++) {
-		delta = git_patch_get_delta(ci->deltas[i]->patch);
+/* state of the pass over a diff in commitinfo_getstats() */
+struct diffpass {
+	struct commitinfo *ci;
+	struct obuf *ob;   /* diff as HTML, NULL when only counting */
+	struct obuf hunks; /* memory buffer for ob */
+	size_t i, j, k;    /* index of the delta, hunk and line */
+	size_t nhunks;
+	unsigned long long size; /* size of the changed lines */
+};
 
-		switch (delta->status) {
-		case GIT_DELTA_ADDED:      c = 'A'; break;
-		case GIT_DELTA_COPIED:     c = 'C'; break;
-		case GIT_DELTA_DELETED:    c = 'D'; break;
-		case GIT_DELTA_MODIFIED:   c = 'M'; break;
-		case GIT_DELTA_RENAMED:    c = 'R'; break;
-		case GIT_DELTA_TYPECHANGE: c = 'T'; break;
-		default:                   c = ' '; break;
-		}
-		if (c == ' ')
-			fprintf(fp, "<tr><td>%c", c);
-		else
-			fprintf(fp, "<tr><td class=\"%c\">%c", c, c);
+int
+diffpass_file(const git_diff_delta *delta, float progress, void *payload)
+{
+	struct diffpass *dp = payload;
+	struct commitinfo *ci = dp->ci;
+	struct obuf *ob = dp->ob;
 
-		fprintf(fp, "</td><td><a href=\"#h%zu\">", i);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		if (strcmp(delta->old_file.path, delta->new_file.path)) {
-			fputs(" -&gt; ", fp);
-			xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		}
+	dp->i = ci->ndeltas++;
+	dp->nhunks = 0;
+	if (ci->deltas)
+		ci->deltas[dp->i].delta = delta;
+	if (!ob)
+		return 0;
+
+	bputs(ob, "<b>diff --git a/<a id=\"");
+	printdiffid(ob, &(dp->i), 1);
+	bputs(ob, "\" href=\"");
+	bputs(ob, relpath);
+	bputs(ob, "file/");
+	xmlencode(ob, delta->old_file.path, strlen(delta->old_file.path));
+	bputs(ob, ".html\">");
+	xmlencode(ob, delta->old_file.path, strlen(delta->old_file.path));
+	bprintf(ob, "</a> b/<a href=\"%sfile/", relpath);
+	xmlencode(ob, delta->new_file.path, strlen(delta->new_file.path));
+	bputs(ob, ".html\">");
+	xmlencode(ob, delta->new_file.path, strlen(delta->new_file.path));
+	bputs(ob, "</a></b>\n");
+
+	/* check binary data, it has no hunks */
+	if (delta->flags & GIT_DIFF_FLAG_BINARY)
+		bputs(ob, "Binary files differ.\n");
 
-		add = ci->deltas[i]->addcount;
-		del = ci->deltas[i]->delcount;
-		changed = add + del;
-		total = sizeof(linestr) - 2;
-		if (changed > total) {
+	return 0;
+}
+
+int
+diffpass_hunk(const git_diff_delta *delta, const git_diff_hunk *hunk,
+	void *payload)
+{
+	struct diffpass *dp = payload;
+	struct obuf *ob = dp->ob;
+	size_t ids[2];
+
+	dp->j = dp->nhunks++;
+	dp->k = 0;
+	if (!ob)
+		return 0;
+
+	ids[0] = dp->i;
+	ids[1] = dp->j;
+	bputs(ob, "<a href=\"#");
+	printdiffid(ob, ids, 2);
+	bputs(ob, "\" id=\"");
+	printdiffid(ob, ids, 2);
+	bputs(ob, "\" class=\"h\">");
+	xmlencode(ob, hunk->header, hunk->header_len);
+	bputs(ob, "</a>");
+
+	return 0;
+}
+
+int
+diffpass_line(const git_diff_delta *delta, const git_diff_hunk *hunk,
+	const git_diff_line *line, void *payload)
+{
+	struct diffpass *dp = payload;
+	struct commitinfo *ci = dp->ci;
+	struct deltainfo *di = ci->deltas ? &ci->deltas[dp->i] : NULL;
+	struct obuf *ob = dp->ob;
+	size_t ids[3] = { dp->i, dp->j, dp->k++ };
+
+	if (line->old_lineno == -1) {
+		ci->addcount++;
+		if (di)
+			di->addcount++;
+	} else if (line->new_lineno == -1) {
+		ci->delcount++;
+		if (di)
+			di->delcount++;
+	}
+	if (!ob)
+		return 0;
+
+	/* too large to show, see printshowfile(): only count the rest */
+	dp->size += line->content_len;
+	if (ci->addcount > MAXDIFFLINES || ci->delcount > MAXDIFFLINES ||
+	    (maxdiff >= 0 && dp->size > (unsigned long long)maxdiff)) {
+		bclose(ob);
+		dp->ob = NULL;
+		return 0;
+	}
+
+	if (line->old_lineno == -1 || line->new_lineno == -1) {
+		bputs(ob, "<a href=\"#");
+		printdiffid(ob, ids, 3);
+		bputs(ob, "\" id=\"");
+		printdiffid(ob, ids, 3);
+		bputs(ob, line->old_lineno == -1 ? "\" class=\"i\">+" :
+		          "\" class=\"d\">-");
+	} else {
+		bputc(ob, ' ');
+	}
+	xmlencode(ob, line->content, line->content_len);
+	if (line->old_lineno == -1 || line->new_lineno == -1)
+		bputs(ob, "</a>");
+
+	return 0;
+}
+
+/* diffstat of the commit, counted in one pass over the diff. If render is
+   set the stats per delta are kept and the diff is written as HTML to
+   ci->hunks in the same pass, unless it is too large to show. Only one
+   patch at a time is kept by libgit2, so the memory used is bounded by the
+   limits of the shown diff. */
+int
+commitinfo_getstats(struct commitinfo *ci, int render, struct logctx *lc)
+{
+	struct diffpass dp;
+	size_t ndeltas;
+
+	if (commitinfo_getdiff(ci))
+		goto err;
+
+	memset(&dp, 0, sizeof(dp));
+	dp.ci = ci;
+	ndeltas = git_diff_num_deltas(ci->diff);
+	if (render && ndeltas && ndeltas <= MAXDIFFFILES) {
+		if (ci->arena)
+			ci->deltas = arena_alloc(ci->arena, &(lc->stats),
+			                         ndeltas * sizeof(struct deltainfo));
+		else if (!(ci->deltas = calloc(ndeltas, sizeof(struct deltainfo))))
+			err(1, "calloc");
+		binit(&(dp.hunks), -1, "diff");
+		dp.ob = &(dp.hunks);
+		if (lc)
+			lc->stats.nheap++;
+	}
+
+	if (git_diff_foreach(ci->diff, diffpass_file, NULL, diffpass_hunk,
+	                     diffpass_line, &dp))
+		goto err;
+	if (dp.ob) {
+		ci->hunks = dp.hunks.buf;
+		ci->hunkslen = dp.hunks.len;
+	}
+	ci->ndeltas = ndeltas;
+	ci->filecount = ndeltas;
+
+	return 0;
+
+err:
+	if (dp.ob)
+		bclose(dp.ob);
+	commitinfo_cleardiff(ci);
+
+	return -1;
+}
+
+void
+printdiffsummary(struct obuf *ob, struct commitinfo *ci)
+{
+	bprintf(ob, "%zu file%s changed, %zu insertion%s(+), %zu deletion%s(-)\n",
+		ci->filecount, ci->filecount == 1 ? "" : "s",
+	        ci->addcount,  ci->addcount  == 1 ? "" : "s",
+	        ci->delcount,  ci->delcount  == 1 ? "" : "s");
+}
+
+void
+printshowfile(struct obuf *ob, struct commitinfo *ci)
+{
+	const git_diff_delta *delta;
+	size_t changed, add, del, total, i;
+	char linestr[80];
+	int c;
+
+	printcommit(ob, ci);
+
+	if (!ci->ndeltas)
+		return;
+
+	if (ci->filecount > MAXDIFFFILES ||
+	    ci->ndeltas   > MAXDIFFFILES ||
+	    ci->addcount  > MAXDIFFLINES ||
+	    ci->delcount  > MAXDIFFLINES ||
+	    !ci->hunks) {
+		bputs(ob, "Diff is too large, output suppressed.\n");
+		printdiffsummary(ob, ci);
+		return;
+	}
+
+	/* diff stat */
+	bputs(ob, "<b>Diffstat:</b>\n<table>");
+	for (i = 0; i < ci->ndeltas; i++) {
+		delta = ci->deltas[i].delta;
+
+		switch (delta->status) {
+		case GIT_DELTA_ADDED:      c = 'A'; break;
+		case GIT_DELTA_COPIED:     c = 'C'; break;
+		case GIT_DELTA_DELETED:    c = 'D'; break;
+		case GIT_DELTA_MODIFIED:   c = 'M'; break;
+		case GIT_DELTA_RENAMED:    c = 'R'; break;
+		case GIT_DELTA_TYPECHANGE: c = 'T'; break;
+		default:                   c = ' '; break;
+		}
+		if (c == ' ')
+			bprintf(ob, "<tr><td>%c", c);
+		else
+			bprintf(ob, "<tr><td class=\"%c\">%c", c, c);
+
+		bputs(ob, "</td><td><a href=\"#");
+		printdiffid(ob, &i, 1);
+		bputs(ob, "\">");
+		xmlencode(ob, delta->old_file.path, strlen(delta->old_file.path));
+		if (strcmp(delta->old_file.path, delta->new_file.path)) {
+			bputs(ob, " -&gt; ");
+			xmlencode(ob, delta->new_file.path, strlen(delta->new_file.path));
+		}
+
+		add = ci->deltas[i].addcount;
+		del = ci->deltas[i].delcount;
+		changed = add + del;
+		total = sizeof(linestr) - 2;
+		if (changed > total) {
 			if (add)
 				add = ((float)total / changed * add) + 1;
 			if (del)
@@ -838,101 +1452,541 @@ printshowfile(FILE *fp, struct commitinfo *ci)
 		memset(&linestr, '+', add);
 		memset(&linestr[add], '-', del);
 
-		fprintf(fp, "</a></td><td> | </td><td class=\"num\">%zu</td><td><span class=\"i\">",
-		        ci->deltas[i]->addcount + ci->deltas[i]->delcount);
-		fwrite(&linestr, 1, add, fp);
-		fputs("</span><span class=\"d\">", fp);
-		fwrite(&linestr[add], 1, del, fp);
-		fputs("</span></td></tr>\n", fp);
+		bputs(ob, "</a></td><td> | </td><td class=\"num\">");
+		bputnum(ob, ci->deltas[i].addcount + ci->deltas[i].delcount, 0);
+		bputs(ob, "</td><td><span class=\"i\">");
+		bwrite(ob, &linestr, add);
+		bputs(ob, "</span><span class=\"d\">");
+		bwrite(ob, &linestr[add], del);
+		bputs(ob, "</span></td></tr>\n");
 	}
-	fprintf(fp, "</table></pre><pre>%zu file%s changed, %zu insertion%s(+), %zu deletion%s(-)\n",
-		ci->filecount, ci->filecount == 1 ? "" : "s",
-	        ci->addcount,  ci->addcount  == 1 ? "" : "s",
-	        ci->delcount,  ci->delcount  == 1 ? "" : "s");
+	bputs(ob, "</table></pre><pre>");
+	printdiffsummary(ob, ci);
 
-	fputs("<hr/>", fp);
+	bputs(ob, "<hr/>");
 
-	for (i = 0; i < ci->ndeltas; i++) {
-		patch = ci->deltas[i]->patch;
-		delta = git_patch_get_delta(patch);
-		fprintf(fp, "<b>diff --git a/<a id=\"h%zu\" href=\"%sfile/", i, relpath);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		fputs(".html\">", fp);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		fprintf(fp, "</a> b/<a href=\"%sfile/", relpath);
-		xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		fprintf(fp, ".html\">");
-		xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		fprintf(fp, "</a></b>\n");
-
-		/* check binary data */
-		if (delta->flags & GIT_DIFF_FLAG_BINARY) {
-			fputs("Binary files differ.\n", fp);
-			continue;
+	bwrite(ob, ci->hunks, ci->hunkslen);
+}
+
+void
+writelogline(struct obuf *ob, struct commitinfo *ci)
+{
+	bputs(ob, "<tr><td>");
+	if (ci->author)
+		printtimeshort(ob, &(ci->author->when));
+	bputs(ob, "</td><td>");
+	if (ci->summary) {
+		bprintf(ob, "<a href=\"%scommit/%s.html\">", relpath, ci->oid);
+		xmlencode(ob, ci->summary, strlen(ci->summary));
+		bputs(ob, "</a>");
+	}
+	bputs(ob, "</td><td>");
+	if (ci->author)
+		xmlencode(ob, ci->author->name, strlen(ci->author->name));
+	bputs(ob, "</td><td class=\"num\" align=\"right\">");
+	bputnum(ob, ci->filecount, 0);
+	bputs(ob, "</td><td class=\"num\" align=\"right\">");
+	bputs(ob, "<span class=\"add-stat\">+");
+	bputnum(ob, ci->addcount, 0);
+	bputs(ob, "</span></td><td class=\"num\" align=\"right\">");
+	bputs(ob, "<span class=\"del-stat\">-");
+	bputnum(ob, ci->delcount, 0);
+	bputs(ob, "</span></td></tr>\n");
+}
+
+void
+logwindow_clear(struct logwindow *lw)
+{
+	git_commit_free(lw->commit);
+	lw->commit = NULL;
+	git_tree_free(lw->tree);
+	lw->tree = NULL;
+}
+
+/* free the state of a log thread and add its allocation stats */
+void
+logctx_free(struct logctx *lc)
+{
+	logwindow_clear(&(lc->window));
+	arena_free(&(lc->arena));
+
+	pthread_mutex_lock(&loglock);
+	allocstats.ncommits += lc->stats.ncommits;
+	allocstats.narena += lc->stats.narena;
+	allocstats.nblocks += lc->stats.nblocks;
+	allocstats.nheap += lc->stats.nheap;
+	if (lc->stats.arenasize > allocstats.arenasize)
+		allocstats.arenasize = lc->stats.arenasize;
+	pthread_mutex_unlock(&loglock);
+}
+
+void
+logjob_run(struct logjob *lj, struct logctx *lc)
+{
+	struct logwindow *lw = &(lc->window);
+	struct commitinfo *ci;
+	char path[PATH_MAX];
+	struct obuf ob;
+	int r;
+
+	lj->status = -1;
+	if (lw->commit && !git_oid_cmp(git_commit_id(lw->commit), &(lj->id))) {
+		ci = commitinfo_getbycommit(lw->commit, lc);
+		ci->commit_tree = lw->tree;
+		lw->commit = NULL;
+		lw->tree = NULL;
+	} else {
+		logwindow_clear(lw);
+		if (!(ci = commitinfo_getbyoid(&(lj->id), lc)))
+			return;
+	}
+	lj->status = 1;
+	/* diffstat: for stagit HTML required for the log.html line, use the
+	   stats store or only count the lines when the commit file exists */
+	if (!lj->exists) {
+		relpath = "../";
+		if (commitinfo_getstats(ci, 1, lc) == -1)
+			goto err;
+		lj->newstats = statsfile != NULL;
+	} else if (statsget(ci) == -1) {
+		if (commitinfo_getstats(ci, 0, lc) == -1)
+			goto err;
+		lj->newstats = statsfile != NULL;
+	}
+	lj->filecount = ci->filecount;
+	lj->addcount = ci->addcount;
+	lj->delcount = ci->delcount;
+
+	relpath = "";
+	binit(&ob, -1, "log row");
+	lc->stats.nheap++;
+	writelogline(&ob, ci);
+	lj->row = ob.buf;
+	lj->rowlen = ob.len;
+	lj->hasparent = ci->parentoid[0] != '\0';
+	lj->status = 0;
+
+	/* check if file exists if so skip it */
+	if (!lj->exists) {
+		r = snprintf(path, sizeof(path), "commit/%s.html", ci->oid);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'commit/%s.html'", ci->oid);
+		relpath = "../";
+		bopen(&ob, path);
+		if (setmtime)
+			ob.mtime = git_commit_time(ci->commit);
+		writeheader(&ob, ci->summary);
+		bputs(&ob, "<pre>");
+		printshowfile(&ob, ci);
+		bputs(&ob, "</pre>\n");
+		writefooter(&ob);
+		bclose(&ob);
+		relpath = "";
+	}
+
+	/* the first parent is the next commit: keep it parsed */
+	lw->commit = ci->parent;
+	lw->tree = ci->parent_tree;
+	ci->parent = NULL;
+	ci->parent_tree = NULL;
+err:
+	commitinfo_free(ci);
+	arena_reset(&(lc->arena), &(lc->stats));
+	lc->stats.ncommits++;
+}
+
+size_t
+oidhash(const git_oid *id)
+{
+	size_t h;
+
+	memcpy(&h, id->id, sizeof(h));
+	return h;
+}
+
+/* value of a commit in the set or -1 */
+long long
+oidsetget(struct oidset *set, const git_oid *id)
+{
+	size_t i, mask;
+
+	if (!set->cap)
+		return -1;
+	mask = set->cap - 1;
+	for (i = oidhash(id) & mask; set->ents[i].used; i = (i + 1) & mask)
+		if (!git_oid_cmp(&(set->ents[i].id), id))
+			return set->ents[i].val;
+	return -1;
+}
+
+/* add a commit which is not in the set yet */
+void
+oidsetadd(struct oidset *set, const git_oid *id, long long val)
+{
+	struct oident *old;
+	size_t i, j, mask, oldcap;
+
+	/* keep the table at most half full */
+	if ((set->n + 1) * 2 > set->cap) {
+		old = set->ents;
+		oldcap = set->cap;
+		set->cap = set->cap ? set->cap * 2 : 4096;
+		if (!(set->ents = calloc(set->cap, sizeof(*(set->ents)))))
+			err(1, "calloc");
+		mask = set->cap - 1;
+		for (i = 0; i < oldcap; i++) {
+			if (!old[i].used)
+				continue;
+			for (j = oidhash(&(old[i].id)) & mask; set->ents[j].used;
+			     j = (j + 1) & mask)
+				;
+			set->ents[j] = old[i];
 		}
+		free(old);
+	}
+	mask = set->cap - 1;
+	for (i = oidhash(id) & mask; set->ents[i].used; i = (i + 1) & mask)
+		;
+	set->ents[i].id = *id;
+	set->ents[i].val = val;
+	set->ents[i].used = 1;
+	set->n++;
+}
 
-		nhunks = git_patch_num_hunks(patch);
-		for (j = 0; j < nhunks; j++) {
-			if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
-				break;
+/* write the log row of a finished job, returns -1 if the log stops here */
+int
+writelogrow(struct obuf *ob, struct logjob *lj)
+{
+	char oidstr[GIT_OID_HEXSZ + 1];
 
-			fprintf(fp, "<a href=\"#h%zu-%zu\" id=\"h%zu-%zu\" class=\"h\">", i, j, i, j);
-			xmlencode(fp, hunk->header, hunk->header_len);
-			fputs("</a>", fp);
-
-			for (k = 0; ; k++) {
-				if (git_patch_get_line_in_hunk(&line, patch, j, k))
-					break;
-				if (line->old_lineno == -1)
-					fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"i\">+",
-						i, j, k, i, j, k);
-				else if (line->new_lineno == -1)
-					fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"d\">-",
-						i, j, k, i, j, k);
-				else
-					fputc(' ', fp);
-				xmlencode(fp, line->content, line->content_len);
-				if (line->old_lineno == -1 || line->new_lineno == -1)
-					fputs("</a>", fp);
+	if (lj->status == -1)
+		return -1;
+	if (lj->status == 0) {
+		if (logpagesize) {
+			if (nlogrows == caplogrows) {
+				caplogrows = caplogrows ? caplogrows * 2 : 1024;
+				if (!(logrowoffs = reallocarray(logrowoffs, caplogrows,
+				                                sizeof(*logrowoffs))))
+					err(1, "realloc");
+				if (!(logrowids = reallocarray(logrowids, caplogrows,
+				                               sizeof(*logrowids))))
+					err(1, "realloc");
 			}
+			logrowids[nlogrows] = lj->id;
+			logrowoffs[nlogrows++] = logrows.len;
+			bwrite(&logrows, lj->row, lj->rowlen);
+		} else if (nlogcommits < 0) {
+			bwrite(ob, lj->row, lj->rowlen);
+		} else if (nlogcommits > 0) {
+			bwrite(ob, lj->row, lj->rowlen);
+			nlogcommits--;
+			if (!nlogcommits && lj->hasparent)
+				bputs(ob, "<tr><td></td><td colspan=\"5\">"
+				          "More commits remaining [...]</td>"
+				          "</tr>\n");
+		}
+
+		if (cachefile && !logpagesize) {
+			fprintf(wcachefp, "%s ", git_oid_tostr(oidstr, sizeof(oidstr), &(lj->id)));
+			fwrite(lj->row, 1, lj->rowlen, wcachefp);
+		}
+	}
+	if (lj->newstats)
+		statsadd(&(lj->id), lj->filecount, lj->addcount, lj->delcount);
+	free(lj->row);
+	lj->row = NULL;
+
+	return 0;
+}
+
+/* take a job of the job server, a worker gives up when pending() says its
+   run has no jobs left, else it could wait for the job of its own process */
+int
+jobtake(int (*pending)(void))
+{
+	struct pollfd pfd = { .fd = jobpipe[0], .events = POLLIN };
+	char c;
+	ssize_t r;
+
+	for (;;) {
+		if (pending && !pending())
+			return 0;
+		if ((r = read(jobpipe[0], &c, 1)) == 1)
+			return 1;
+		if (r == 0 || (errno != EINTR && errno != EAGAIN))
+			err(1, "read: job server");
+		if (errno == EAGAIN && poll(&pfd, 1, 100) == -1 && errno != EINTR)
+			err(1, "poll: job server");
+	}
+}
+
+void
+jobgive(void)
+{
+	while (write(jobpipe[1], "+", 1) != 1)
+		if (errno != EINTR)
+			err(1, "write: job server");
+}
+
+/* worker i of a run, the ones after the first share the job server */
+int
+jobshared(void *arg)
+{
+	return jobpipe[0] != -1 && (intptr_t)arg > 0;
+}
+
+int
+logpending(void)
+{
+	int r;
+
+	pthread_mutex_lock(&loglock);
+	r = nextlogjob < nlogjobs;
+	pthread_mutex_unlock(&loglock);
+
+	return r;
+}
+
+void *
+logworker(void *arg)
+{
+	struct logctx lc = { 0 };
+	struct logjob *lj;
+	size_t i, n;
+	int shared = jobshared(arg);
+
+	if (git_repository_open_ext(&repo, repodir,
+		GIT_REPOSITORY_OPEN_NO_SEARCH, NULL) < 0)
+		errx(1, "%s: cannot open repository", repodir);
+	if (useuring)
+		buringopen();
+
+	for (;;) {
+		if (shared && !jobtake(logpending))
+			break;
+		/* take consecutive jobs so the parent commit can be reused */
+		pthread_mutex_lock(&loglock);
+		lj = &logjobs[nextlogjob];
+		n = nlogjobs - nextlogjob < LOGBATCH ? nlogjobs - nextlogjob : LOGBATCH;
+		nextlogjob += n;
+		pthread_mutex_unlock(&loglock);
+		if (!n) {
+			if (shared)
+				jobgive();
+			break;
 		}
+
+		for (i = 0; i < n; i++) {
+			logjob_run(&lj[i], &lc);
+
+			pthread_mutex_lock(&loglock);
+			lj[i].done = 1;
+			pthread_cond_signal(&logcond);
+			pthread_mutex_unlock(&loglock);
+		}
+		if (shared)
+			jobgive();
 	}
+	logctx_free(&lc);
+	buringclose();
+	git_repository_free(repo);
+	repo = NULL;
+
+	return NULL;
 }
 
+/* run the queued jobs on the worker threads, the rows are written in order
+   by the calling thread as they finish. */
 void
-writelogline(FILE *fp, struct commitinfo *ci)
+writelogjobs(struct obuf *ob, struct logjob *ljs, size_t nljs)
 {
-	fputs("<tr><td>", fp);
-	if (ci->author)
-		printtimeshort(fp, &(ci->author->when));
-	fputs("</td><td>", fp);
-	if (ci->summary) {
-		fprintf(fp, "<a href=\"%scommit/%s.html\">", relpath, ci->oid);
-		xmlencode(fp, ci->summary, strlen(ci->summary));
-		fputs("</a>", fp);
+	pthread_t *threads;
+	size_t i, n;
+	int r;
+
+	n = nthreads < (long long)nljs ? (size_t)nthreads : nljs;
+	if (!(threads = calloc(n, sizeof(*threads))))
+		err(1, "calloc");
+
+	logjobs = ljs;
+	nlogjobs = nljs;
+	nextlogjob = 0;
+	for (i = 0; i < n; i++)
+		if ((r = pthread_create(&threads[i], NULL, logworker, (void *)(intptr_t)i)))
+			errx(1, "pthread_create: %s", strerror(r));
+
+	for (i = 0; i < nljs; i++) {
+		pthread_mutex_lock(&loglock);
+		while (!ljs[i].done)
+			pthread_cond_wait(&logcond, &loglock);
+		pthread_mutex_unlock(&loglock);
+
+		if (writelogrow(ob, &ljs[i]) == -1) {
+			/* stop handing out the remaining jobs */
+			pthread_mutex_lock(&loglock);
+			nlogjobs = nextlogjob;
+			pthread_mutex_unlock(&loglock);
+			break;
+		}
 	}
-	fputs("</td><td>", fp);
-	if (ci->author)
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-	fputs("</td><td class=\"num\" align=\"right\">", fp);
-	fprintf(fp, "%zu", ci->filecount);
-	fputs("</td><td class=\"num\" align=\"right\">", fp);
-	fputs("<span class=\"add-stat\">+", fp);
-	fprintf(fp, "%zu", ci->addcount);
-	fputs("</span></td><td class=\"num\" align=\"right\">", fp);
-	fputs("<span class=\"del-stat\">-", fp);
-	fprintf(fp, "%zu", ci->delcount);
-	fputs("</span></td></tr>\n", fp);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < nljs; i++)
+		free(ljs[i].row);
+	free(threads);
+	logjobs = NULL;
+	nlogjobs = nextlogjob = 0;
+}
+
+/* end of a log row, the text in it is encoded */
+const char *
+rowend(const char *p, const char *end)
+{
+	for (; end - p >= 6; p++)
+		if (!memcmp(p, "</tr>\n", 6))
+			return p + 6;
+	return NULL;
+}
+
+/* read the log cache of the last run (does not need to exist) */
+void
+logcacheload(void)
+{
+	struct cacherow *cr;
+	struct stat st;
+	git_oid head;
+	FILE *fp;
+	const char *p, *end;
+	long long pagesize, total;
+	size_t i, nrows;
+
+	if (!(fp = fopen(cachefile, "r")))
+		return;
+	if (fstat(fileno(fp), &st) == -1)
+		err(1, "fstat: '%s'", cachefile);
+	if (!(logcachedata = malloc((size_t)st.st_size + 1)))
+		err(1, "malloc");
+	i = fread(logcachedata, 1, st.st_size, fp);
+	if (ferror(fp))
+		err(1, "fread: '%s'", cachefile);
+	fclose(fp);
+	logcachedata[i] = '\0';
+	p = logcachedata;
+	end = p + i;
+
+	/* last commit id (HEAD) */
+	if (end - p <= GIT_OID_HEXSZ || p[GIT_OID_HEXSZ] != '\n' ||
+	    git_oid_fromstrn(&head, p, GIT_OID_HEXSZ))
+		errx(1, "%s: no object id", cachefile);
+	p += GIT_OID_HEXSZ + 1;
+	if (logpagesize) {
+		if (sscanf(p, "page %lld %lld\n", &pagesize, &nlogcached) != 2 ||
+		    nlogcached < 0)
+			errx(1, "%s: not a cache of a paginated log", cachefile);
+		if (pagesize != logpagesize)
+			errx(1, "%s: pages of %lld rows", cachefile, pagesize);
+		p = strchr(p, '\n') + 1;
+		/* rows without the commit ids: write all the pages again */
+		if (p < end && *p == '<') {
+			nlogcached = 0;
+			return;
+		}
+	} else if (p < end && *p == 'p') {
+		errx(1, "%s: cache of a paginated log, use -p", cachefile);
+	}
+
+	/* "id row" or only the row (older caches), "id" for the newest commit
+	   of a page before the newest one */
+	while (p < end) {
+		if (ncacherows == capcacherows) {
+			capcacherows = capcacherows ? capcacherows * 2 : 1024;
+			if (!(cacherows = reallocarray(cacherows, capcacherows,
+			                               sizeof(*cacherows))))
+				err(1, "realloc");
+		}
+		cr = &cacherows[ncacherows++];
+		memset(cr, 0, sizeof(*cr));
+		if (*p != '<') {
+			if (end - p <= GIT_OID_HEXSZ ||
+			    git_oid_fromstrn(&(cr->id), p, GIT_OID_HEXSZ))
+				errx(1, "%s: invalid row", cachefile);
+			cr->hasid = 1;
+			p += GIT_OID_HEXSZ;
+			if (*p == '\n' && logpagesize) {
+				p++;
+				continue;
+			}
+			if (*p++ != ' ')
+				errx(1, "%s: invalid row", cachefile);
+		}
+		cr->row = p;
+		if (!(p = rowend(p, end)))
+			errx(1, "%s: invalid row", cachefile);
+		cr->rowlen = p - cr->row;
+	}
+
+	/* position from the root: the rows are consecutive, the pages before
+	   them logpagesize rows apart */
+	for (nrows = 0; nrows < ncacherows && cacherows[nrows].row; nrows++)
+		;
+	total = logpagesize ? nlogcached : (long long)ncacherows;
+	for (i = 0; i < ncacherows; i++) {
+		if (i < nrows)
+			cacherows[i].pos = total - 1 - i;
+		else if (!cacherows[i].row)
+			cacherows[i].pos = total - nrows - 1 - (i - nrows) * logpagesize;
+		else
+			errx(1, "%s: invalid row", cachefile);
+		if (cacherows[i].pos < 0)
+			errx(1, "%s: invalid row", cachefile);
+	}
+
+	/* the log stops at the last HEAD or at the merge-base of its history
+	   and the rewritten one */
+	if (ncacherows)
+		oidsetadd(&cacheids, &head, 0);
+	for (i = 0; i < ncacherows; i++)
+		if (cacherows[i].hasid && oidsetget(&cacheids, &(cacherows[i].id)) == -1)
+			oidsetadd(&cacheids, &(cacherows[i].id), i);
+	cachestop = ncacherows;
+}
+
+void
+logcachefree(void)
+{
+	free(cacherows);
+	cacherows = NULL;
+	ncacherows = capcacherows = cachestop = 0;
+	free(cacheids.ents);
+	memset(&cacheids, 0, sizeof(cacheids));
+	free(logcachedata);
+	logcachedata = NULL;
+}
+
+/* write a cached row to the new cache */
+void
+writecacherow(FILE *fp, const struct cacherow *cr)
+{
+	char oidstr[GIT_OID_HEXSZ + 1];
+
+	if (cr->hasid)
+		fprintf(fp, cr->row ? "%s " : "%s\n",
+		        git_oid_tostr(oidstr, sizeof(oidstr), &(cr->id)));
+	if (cr->row)
+		fwrite(cr->row, 1, cr->rowlen, fp);
 }
 
 int
-writelog(FILE *fp, const git_oid *oid)
+writelog(struct obuf *ob, const git_oid *oid)
 {
-	struct commitinfo *ci;
+	struct logctx lc = { 0 };
+	struct logjob lj, *ljs = NULL;
 	git_revwalk *w = NULL;
 	git_oid id;
 	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1];
-	FILE *fpfile;
+	size_t nljs = 0, capljs = 0;
+	long long nrows = 0, maxrows = nlogcommits, n;
 	int r;
 
 	git_revwalk_new(&w, repo);
@@ -942,120 +1996,357 @@ writelog(FILE *fp, const git_oid *oid)
 	while (!git_revwalk_next(&id, w)) {
 		relpath = "";
 
-		if (cachefile && !memcmp(&id, &lastoid, sizeof(id)))
+		/* HEAD as the newest commit of an older page has no cached
+		   row for log.html: continue to the page before it */
+		if ((n = oidsetget(&cacheids, &id)) != -1 &&
+		    (nrows || cacherows[n].row)) {
+			cachestop = n;
+			break;
+		}
+		/* the older commits are written by the backfill */
+		if (landing && nrows >= prioritycommits)
 			break;
 
 		git_oid_tostr(oidstr, sizeof(oidstr), &id);
 		r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
 		if (r < 0 || (size_t)r >= sizeof(path))
 			errx(1, "path truncated: 'commit/%s.html'", oidstr);
-		r = access(path, F_OK);
+
+		memset(&lj, 0, sizeof(lj));
+		lj.id = id;
+		lj.exists = !access(path, F_OK);
 
 		/* optimization: if there are no log lines to write and
 		   the commit file already exists: skip the diffstat */
-		if (!nlogcommits && !r)
+		if (maxrows >= 0 && nrows >= maxrows && lj.exists)
 			continue;
+		nrows++;
+
+		/* queue for the workers, the rows are written afterwards */
+		if (nthreads > 1) {
+			if (nljs == capljs) {
+				capljs = capljs ? capljs * 2 : 1024;
+				if (!(ljs = reallocarray(ljs, capljs, sizeof(*ljs))))
+					err(1, "realloc");
+			}
+			ljs[nljs++] = lj;
+			continue;
+		}
 
-		if (!(ci = commitinfo_getbyoid(&id)))
+		logjob_run(&lj, &lc);
+		if (writelogrow(ob, &lj) == -1)
 			break;
-		/* diffstat: for stagit HTML required for the log.html line */
-		if (commitinfo_getstats(ci) == -1)
-			goto err;
+	}
+	logctx_free(&lc);
+	git_revwalk_free(w);
+	if (verbose && cachestop)
+		fprintf(stderr, "log: HEAD rewritten, %lld rows of the cache kept\n",
+		        cachestop < ncacherows ? cacherows[cachestop].pos + 1 : 0);
+
+	if (nljs)
+		writelogjobs(ob, ljs, nljs);
+	free(ljs);
+
+	/* without the arena each allocation it served would be a calloc(): that
+	   figure is counted, not measured on a path without the arena */
+	if (verbose && allocstats.ncommits)
+		fprintf(stderr, "log: %zu commits, allocations per commit: "
+		        "%.1f estimated without the arena, %.1f now "
+		        "(arena block %zu bytes)\n",
+		        allocstats.ncommits,
+		        (double)(allocstats.narena + allocstats.nheap) / allocstats.ncommits,
+		        (double)(allocstats.nblocks + allocstats.nheap) / allocstats.ncommits,
+		        allocstats.arenasize ? allocstats.arenasize : (size_t)ARENABLOCK);
 
-		if (nlogcommits < 0) {
-			writelogline(fp, ci);
-		} else if (nlogcommits > 0) {
-			writelogline(fp, ci);
-			nlogcommits--;
-			if (!nlogcommits && ci->parentoid[0])
-				fputs("<tr><td></td><td colspan=\"5\">"
-				      "More commits remaining [...]</td>"
-				      "</tr>\n", fp);
+	relpath = "";
+
+	return 0;
+}
+
+/* write the missing commit pages of head, at most BACKFILLCHUNK of them,
+   from next if resume. Returns 1 if there are more, then next is the commit
+   the chunk stopped at. The rows are not written, with -s the diffstats are
+   kept. */
+int
+backfill(const git_oid *head, git_oid *next, int resume)
+{
+	struct logctx lc = { 0 };
+	struct logjob *ljs;
+	git_revwalk *w = NULL;
+	git_oid id;
+	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1];
+	size_t nljs = 0, i;
+	int r, more = 0;
+
+	if (!(ljs = calloc(BACKFILLCHUNK, sizeof(*ljs))))
+		err(1, "calloc");
+
+	git_revwalk_new(&w, repo);
+	git_revwalk_push(w, resume ? next : head);
+	git_revwalk_simplify_first_parent(w);
+
+	while (!git_revwalk_next(&id, w)) {
+		git_oid_tostr(oidstr, sizeof(oidstr), &id);
+		r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'commit/%s.html'", oidstr);
+		if (!access(path, F_OK))
+			continue;
+		if (nljs == BACKFILLCHUNK) {
+			*next = id;
+			more = 1;
+			break;
+		}
+		ljs[nljs++].id = id;
+	}
+	git_revwalk_free(w);
+
+	if (nthreads > 1 && nljs > 1) {
+		writelogjobs(NULL, ljs, nljs);
+	} else {
+		for (i = 0; i < nljs; i++) {
+			logjob_run(&ljs[i], &lc);
+			if (writelogrow(NULL, &ljs[i]) == -1)
+				break;
+		}
+		for (i = 0; i < nljs; i++)
+			free(ljs[i].row);
+		logctx_free(&lc);
+	}
+	free(ljs);
+	relpath = "";
+
+	if (verbose)
+		fprintf(stderr, "backfill: %zu commit pages written%s\n", nljs,
+		        more ? ", more to go" : "");
+
+	return more;
+}
+
+/* write log rows made with an empty relpath for the current one */
+void
+writelogrows(struct obuf *ob, const char *rows, size_t len)
+{
+	const char *p, *end = rows + len;
+
+	for (p = rows; relpath[0] && end - p >= 6; p++) {
+		if (memcmp(p, "href=\"", 6))
+			continue;
+		bwrite(ob, rows, p + 6 - rows);
+		bputs(ob, relpath);
+		rows = p += 6;
+	}
+	bwrite(ob, rows, end - rows);
+}
+
+void
+writelognav(struct obuf *ob, long long n, long long last)
+{
+	bputs(ob, "<p class=\"small center\">");
+	if (n < last)
+		bprintf(ob, "<a href=\"%slog/%lld.html\">&larr; Newer</a> | ",
+		        relpath, n + 1);
+	/* not the number of pages: older pages are not written again */
+	bprintf(ob, "Page %lld", n + 1);
+	if (n > 0)
+		bprintf(ob, " | <a href=\"%slog/%lld.html\">Older &rarr;</a>",
+		        relpath, n - 1);
+	bputs(ob, "</p>\n");
+}
+
+/* write the log page n of last, page 0 has the oldest rows. Of the total
+   rows, newest first, the new rows come before the kept cached ones. */
+void
+writelogpage(const char *path, long long n, long long last, long long total)
+{
+	struct cacherow *cr;
+	struct obuf ob;
+	long long a, b, i;
+
+	bopen(&ob, path);
+	if (setmtime)
+		ob.mtime = headtime;
+	writeheader(&ob, "Log");
+	writelognav(&ob, n, last);
+	bputs(&ob, "<table id=\"log\"><thead>\n<tr><td><b>Date</b></td>"
+	           "<td><b>Commit message</b></td>"
+	           "<td><b>Author</b></td><td class=\"num\" align=\"right\"><b>Files</b></td>"
+	           "<td class=\"num\" align=\"right\"><b>+</b></td>"
+	           "<td class=\"num\" align=\"right\"><b>-</b></td></tr>\n</thead><tbody>\n");
+
+	/* rows n * logpagesize up to the next page, counted from the root */
+	a = total - (n + 1) * logpagesize;
+	if (a < 0)
+		a = 0;
+	b = total - n * logpagesize;
+	for (i = a; i < b; i++) {
+		if (i < (long long)nlogrows) {
+			writelogrows(&ob, logrows.buf + logrowoffs[i],
+			             (i + 1 < (long long)nlogrows ? logrowoffs[i + 1] :
+			             logrows.len) - logrowoffs[i]);
+		} else {
+			cr = &cacherows[cachestop + (i - nlogrows)];
+			writelogrows(&ob, cr->row, cr->rowlen);
 		}
+	}
+
+	bputs(&ob, "</tbody></table>");
+	writelognav(&ob, n, last);
+	writefooter(&ob);
+	bclose(&ob);
+}
+
+/* write the log in pages of logpagesize rows: log/<n>.html and log.html, a
+   copy of the newest page. With the cache only the pages from the newest of
+   the last run, or from the merge-base after a rewrite of HEAD, are
+   written. */
+void
+writelogpages(const git_oid *head, char *tmppath)
+{
+	struct cacherow *cr;
+	const git_oid *id;
+	const char *row;
+	char path[PATH_MAX], buf[GIT_OID_HEXSZ + 1];
+	long long first, last, total, n, pos, t;
+	size_t i, nkept, rowlen;
+	int fd, r;
+
+	if (cachefile && head)
+		logcacheload();
+
+	binit(&logrows, -1, "log rows");
+	if (head)
+		writelog(NULL, head);
+
+	/* the cache up to the commit the log stopped at */
+	nlogcached = cachestop < ncacherows ? cacherows[cachestop].pos + 1 : 0;
+	for (nkept = 0; cachestop + nkept < ncacherows &&
+	     cacherows[cachestop + nkept].row; nkept++)
+		;
+
+	mkdir("log", S_IRWXU | S_IRWXG | S_IRWXO);
+	total = nlogcached + nlogrows;
+	first = nkept ? (nlogcached - 1) / logpagesize : nlogcached / logpagesize;
+	last = total ? (total - 1) / logpagesize : 0;
+	relpath = "../";
+	for (n = first; n <= last && total; n++) {
+		r = snprintf(path, sizeof(path), "log/%lld.html", n);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'log/%lld.html'", n);
+		writelogpage(path, n, last, total);
+	}
+	relpath = "";
+	writelogpage("log.html", last, last, total);
+	nlogpages = total ? last + 1 : 0;
 
-		if (cachefile)
-			writelogline(wcachefp, ci);
-
-		/* check if file exists if so skip it */
-		if (r) {
-			relpath = "../";
-			fpfile = efopen(path, "w");
-			writeheader(fpfile, ci->summary);
-			fputs("<pre>", fpfile);
-			printshowfile(fpfile, ci);
-			fputs("</pre>\n", fpfile);
-			writefooter(fpfile);
-			fclose(fpfile);
+	if (cachefile && head) {
+		if ((fd = mkstemp(tmppath)) == -1)
+			err(1, "mkstemp");
+		if (!(wcachefp = fdopen(fd, "w")))
+			err(1, "fdopen: '%s'", tmppath);
+		git_oid_tostr(buf, sizeof(buf), head);
+		fprintf(wcachefp, "%s\npage %lld %lld\n", buf, logpagesize, total);
+		/* the rows of the newest page, then the newest commit of each
+		   older page */
+		n = total - last * logpagesize;
+		for (t = 0; t < (long long)(nlogrows + nkept); t++) {
+			pos = total - 1 - t;
+			if (t >= n && (pos + 1) % logpagesize)
+				continue;
+			if (t < (long long)nlogrows) {
+				id = &logrowids[t];
+				row = logrows.buf + logrowoffs[t];
+				rowlen = (t + 1 < (long long)nlogrows ? logrowoffs[t + 1] :
+				          logrows.len) - logrowoffs[t];
+			} else {
+				cr = &cacherows[cachestop + (t - nlogrows)];
+				id = &(cr->id);
+				row = cr->row;
+				rowlen = cr->rowlen;
+			}
+			git_oid_tostr(buf, sizeof(buf), id);
+			if (t < n) {
+				fprintf(wcachefp, "%s ", buf);
+				fwrite(row, 1, rowlen, wcachefp);
+			} else {
+				fprintf(wcachefp, "%s\n", buf);
+			}
 		}
-err:
-		commitinfo_free(ci);
+		for (i = cachestop + nkept; i < ncacherows; i++)
+			writecacherow(wcachefp, &cacherows[i]);
+		if (fflush(wcachefp) || ferror(wcachefp))
+			err(1, "fwrite: '%s'", tmppath);
+		fclose(wcachefp);
 	}
-	git_revwalk_free(w);
 
-	relpath = "";
-
-	return 0;
+	bclose(&logrows);
+	free(logrowoffs);
+	logrowoffs = NULL;
+	free(logrowids);
+	logrowids = NULL;
+	nlogrows = caplogrows = 0;
+	logcachefree();
 }
 
 void
-printcommitatom(FILE *fp, struct commitinfo *ci, const char *tag)
+printcommitatom(struct obuf *ob, struct commitinfo *ci, const char *tag)
 {
-	fputs("<entry>\n", fp);
+	bputs(ob, "<entry>\n");
 
-	fprintf(fp, "<id>%s</id>\n", ci->oid);
+	bprintf(ob, "<id>%s</id>\n", ci->oid);
 	if (ci->author) {
-		fputs("<published>", fp);
-		printtimez(fp, &(ci->author->when));
-		fputs("</published>\n", fp);
+		bputs(ob, "<published>");
+		printtimez(ob, &(ci->author->when));
+		bputs(ob, "</published>\n");
 	}
 	if (ci->committer) {
-		fputs("<updated>", fp);
-		printtimez(fp, &(ci->committer->when));
-		fputs("</updated>\n", fp);
+		bputs(ob, "<updated>");
+		printtimez(ob, &(ci->committer->when));
+		bputs(ob, "</updated>\n");
 	}
 	if (ci->summary) {
-		fputs("<title type=\"text\">", fp);
+		bputs(ob, "<title type=\"text\">");
 		if (tag && tag[0]) {
-			fputs("[", fp);
-			xmlencode(fp, tag, strlen(tag));
-			fputs("] ", fp);
+			bputs(ob, "[");
+			xmlencode(ob, tag, strlen(tag));
+			bputs(ob, "] ");
 		}
-		xmlencode(fp, ci->summary, strlen(ci->summary));
-		fputs("</title>\n", fp);
+		xmlencode(ob, ci->summary, strlen(ci->summary));
+		bputs(ob, "</title>\n");
 	}
-	fprintf(fp, "<link rel=\"alternate\" type=\"text/html\" href=\"commit/%s.html\" />\n",
+	bprintf(ob, "<link rel=\"alternate\" type=\"text/html\" href=\"commit/%s.html\" />\n",
 	        ci->oid);
 
 	if (ci->author) {
-		fputs("<author>\n<name>", fp);
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs("</name>\n<email>", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("</email>\n</author>\n", fp);
+		bputs(ob, "<author>\n<name>");
+		xmlencode(ob, ci->author->name, strlen(ci->author->name));
+		bputs(ob, "</name>\n<email>");
+		xmlencode(ob, ci->author->email, strlen(ci->author->email));
+		bputs(ob, "</email>\n</author>\n");
 	}
 
-	fputs("<content type=\"text\">", fp);
-	fprintf(fp, "commit %s\n", ci->oid);
+	bputs(ob, "<content type=\"text\">");
+	bprintf(ob, "commit %s\n", ci->oid);
 	if (ci->parentoid[0])
-		fprintf(fp, "parent %s\n", ci->parentoid);
+		bprintf(ob, "parent %s\n", ci->parentoid);
 	if (ci->author) {
-		fputs("Author: ", fp);
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs(" &lt;", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("&gt;\nDate:   ", fp);
-		printtime(fp, &(ci->author->when));
-		fputc('\n', fp);
+		bputs(ob, "Author: ");
+		xmlencode(ob, ci->author->name, strlen(ci->author->name));
+		bputs(ob, " &lt;");
+		xmlencode(ob, ci->author->email, strlen(ci->author->email));
+		bputs(ob, "&gt;\nDate:   ");
+		printtime(ob, &(ci->author->when));
+		bputc(ob, '\n');
 	}
 	if (ci->msg) {
-		fputc('\n', fp);
-		xmlencode(fp, ci->msg, strlen(ci->msg));
+		bputc(ob, '\n');
+		xmlencode(ob, ci->msg, strlen(ci->msg));
 	}
-	fputs("\n</content>\n</entry>\n", fp);
+	bputs(ob, "\n</content>\n</entry>\n");
 }
 
 int
-writeatom(FILE *fp, int all)
+writeatom(struct obuf *ob, int all)
 {
 	struct referenceinfo *ris = NULL;
 	size_t refcount = 0;
@@ -1064,12 +2355,12 @@ writeatom(FILE *fp, int all)
 	git_oid id;
 	size_t i, m = 100; /* last 'm' commits */
 
-	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-	      "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>", fp);
-	xmlencode(fp, strippedname, strlen(strippedname));
-	fputs(", branch HEAD</title>\n<subtitle>", fp);
-	xmlencode(fp, description, strlen(description));
-	fputs("</subtitle>\n", fp);
+	bputs(ob, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	          "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>");
+	xmlencode(ob, strippedname, strlen(strippedname));
+	bputs(ob, ", branch HEAD</title>\n<subtitle>");
+	xmlencode(ob, description, strlen(description));
+	bputs(ob, "</subtitle>\n");
 
 	/* all commits or only tags? */
 	if (all) {
@@ -1077,9 +2368,9 @@ writeatom(FILE *fp, int all)
 		git_revwalk_push_head(w);
 		git_revwalk_simplify_first_parent(w);
 		for (i = 0; i < m && !git_revwalk_next(&id, w); i++) {
-			if (!(ci = commitinfo_getbyoid(&id)))
+			if (!(ci = commitinfo_getbyoid(&id, NULL)))
 				break;
-			printcommitatom(fp, ci, "");
+			printcommitatom(ob, ci, "");
 			commitinfo_free(ci);
 		}
 		git_revwalk_free(w);
@@ -1087,7 +2378,7 @@ writeatom(FILE *fp, int all)
 		/* references: tags */
 		for (i = 0; i < refcount; i++) {
 			if (git_reference_is_tag(ris[i].ref))
-				printcommitatom(fp, ris[i].ci,
+				printcommitatom(ob, ris[i].ci,
 				                git_reference_shorthand(ris[i].ref));
 
 			commitinfo_free(ris[i].ci);
@@ -1096,269 +2387,975 @@ writeatom(FILE *fp, int all)
 		free(ris);
 	}
 
-	fputs("</feed>\n", fp);
+	bputs(ob, "</feed>\n");
 
 	return 0;
 }
 
+void
+manifestadd(const char *path, int status, unsigned long long size,
+	unsigned long long hash)
+{
+	pthread_mutex_lock(&manifestlock);
+	bputc(&wmanifest, status);
+	bputc(&wmanifest, ' ');
+	bputnum(&wmanifest, size, 0);
+	if (status == 'D')
+		bputs(&wmanifest, " - ");
+	else
+		bprintf(&wmanifest, " %016llx ", hash);
+	bputs(&wmanifest, path);
+	bputc(&wmanifest, '\n');
+	pthread_mutex_unlock(&manifestlock);
+}
+
+/* add a file written other than by bclose() */
+void
+manifestfile(int dirfd, const char *name, const char *path, int status)
+{
+	unsigned long long size, hash;
+
+	if (manifest && !hashfile(dirfd, name, &size, &hash))
+		manifestadd(path, status, size, hash);
+}
+
+size_t
+dirhash(const char *path, size_t len)
+{
+	size_t h = 5381;
+
+	while (len--)
+		h = h * 33 + (unsigned char)*path++;
+	return h;
+}
+
+/* open the directory of len bytes of path, create it if needed, the lock is
+   held. Returns the descriptor and if it is in the cache or -1 on error */
 int
-writeblob(git_object *obj, const char *fpath, const char *filename, git_off_t filesize)
+diropenlocked(const char *path, size_t len, int *cached)
+{
+	struct pagedir *dp, *old;
+	size_t i, j, mask, oldcap, plen;
+	const char *p;
+	char name[PATH_MAX];
+	int pfd, pcached, fd;
+
+	*cached = 1;
+	if (!len)
+		return AT_FDCWD;
+	if (capdirs) {
+		mask = capdirs - 1;
+		for (i = dirhash(path, len) & mask; dirs[i].path; i = (i + 1) & mask)
+			if (!strncmp(dirs[i].path, path, len) && !dirs[i].path[len])
+				return dirs[i].fd;
+	}
+
+	for (p = path + len; p > path && p[-1] != '/'; p--)
+		;
+	plen = p > path ? (size_t)(p - path) - 1 : 0;
+	if ((size_t)(path + len - p) >= sizeof(name))
+		errx(1, "path truncated: '%.*s'", (int)len, path);
+	memcpy(name, p, path + len - p);
+	name[path + len - p] = '\0';
+
+	if ((pfd = diropenlocked(path, plen, &pcached)) == -1)
+		return -1;
+	if (mkdirat(pfd, name, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+		fd = -1;
+	else
+		fd = openat(pfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (!pcached)
+		close(pfd);
+	if (fd == -1)
+		return -1;
+
+	/* past the limit of open descriptors the directory is not kept */
+	if (ndirs >= DIRCACHEMAX) {
+		*cached = 0;
+		return fd;
+	}
+	/* keep the table at most half full */
+	if ((ndirs + 1) * 2 > capdirs) {
+		old = dirs;
+		oldcap = capdirs;
+		capdirs = capdirs ? capdirs * 2 : 64;
+		if (!(dirs = calloc(capdirs, sizeof(*dirs))))
+			err(1, "calloc");
+		mask = capdirs - 1;
+		for (i = 0; i < oldcap; i++) {
+			if (!old[i].path)
+				continue;
+			for (j = dirhash(old[i].path, strlen(old[i].path)) & mask;
+			     dirs[j].path; j = (j + 1) & mask)
+				;
+			dirs[j] = old[i];
+		}
+		free(old);
+	}
+	mask = capdirs - 1;
+	for (i = dirhash(path, len) & mask; dirs[i].path; i = (i + 1) & mask)
+		;
+	dp = &dirs[i];
+	if (!(dp->path = strndup(path, len)))
+		err(1, "strndup");
+	dp->fd = fd;
+	ndirs++;
+
+	return fd;
+}
+
+/* open the directory of the file at path, create it if needed and set base
+   to the name of the file in it. The descriptor is closed by the caller if
+   it is not in the cache */
+int
+diropen(const char *path, const char **base, int *cached)
 {
-	char tmp[PATH_MAX] = "", *d;
 	const char *p;
-	int lc = 0;
+	int fd;
+
+	*base = (p = strrchr(path, '/')) ? p + 1 : path;
+	pthread_mutex_lock(&dirlock);
+	fd = diropenlocked(path, p ? (size_t)(p - path) : 0, cached);
+	pthread_mutex_unlock(&dirlock);
+
+	return fd;
+}
+
+void
+dirsfree(void)
+{
+	size_t i;
+
+	for (i = 0; i < capdirs; i++) {
+		if (!dirs[i].path)
+			continue;
+		close(dirs[i].fd);
+		free(dirs[i].path);
+	}
+	free(dirs);
+	dirs = NULL;
+	ndirs = capdirs = 0;
+}
+
+int
+writeblob(git_object *obj, const char *fpath, const char *filename, git_off_t filesize)
+{
+	char tmp[PATH_MAX] = "";
+	const char *p, *base;
+	int dfd, cached, lc = 0;
+	struct obuf ob;
+
+	if ((dfd = diropen(fpath, &base, &cached)) == -1)
+		return -1;
+
+	for (p = fpath; *p; p++) {
+		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
+			errx(1, "path truncated: '../%s'", tmp);
+	}
+	relpath = tmp;
+
+	bopenat(&ob, dfd, base, fpath);
+	if (setmtime)
+		ob.mtime = headtime;
+	writeheader(&ob, filename);
+	bputs(&ob, "<p class=\"filename\"> ");
+	xmlencode(&ob, filename, strlen(filename));
+	bprintf(&ob, " (%juB)", (uintmax_t)filesize);
+	bputs(&ob, "</p>");
+
+
+    if (git_blob_is_binary((git_blob *)obj)) {
+        bputs(&ob, "<p class=\"binary-file\">Binary file.</p>\n");
+    } else {
+#ifdef WITH_MD4C
+        /* README.md など Markdown なら md4c で HTML 描画 */
+        if (is_markdown_filename(filename)) {
+            const char *s = git_blob_rawcontent((git_blob *)obj);
+            git_off_t len = git_blob_rawsize((git_blob *)obj);
+            /* お好みでラッパー要素を追加（CSS: .markdown-body を当てやすく） */
+            bputs(&ob, "<section class=\"panel markdown-body\">\n");
+            if (render_markdown_with_links(&ob, s, (size_t)len) != 0) {
+                /* 失敗時は従来のプレーン表示へフォールバック */
+                bputs(&ob, "</section>\n");
+                lc = writeblobhtml(&ob, (git_blob *)obj, filename);
+            } else {
+                bputs(&ob, "\n</section>\n");
+                lc = 0; /* 行番号を出していないので 0 扱い */
+            }
+        } else
+#endif
+        {
+            lc = writeblobhtml(&ob, (git_blob *)obj, filename);
+        }
+    }
+
+	writefooter(&ob);
+	bclose(&ob);
+	if (!cached)
+		close(dfd);
+
+	relpath = "";
+
+	return lc;
+}
+
+const char *
+filemode(git_filemode_t m)
+{
+	static char mode[11];
+
+	memset(mode, '-', sizeof(mode) - 1);
+	mode[10] = '\0';
+
+	if (S_ISREG(m))
+		mode[0] = '-';
+	else if (S_ISBLK(m))
+		mode[0] = 'b';
+	else if (S_ISCHR(m))
+		mode[0] = 'c';
+	else if (S_ISDIR(m))
+		mode[0] = 'd';
+	else if (S_ISFIFO(m))
+		mode[0] = 'p';
+	else if (S_ISLNK(m))
+		mode[0] = 'l';
+	else if (S_ISSOCK(m))
+		mode[0] = 's';
+	else
+		mode[0] = '?';
+
+	if (m & S_IRUSR) mode[1] = 'r';
+	if (m & S_IWUSR) mode[2] = 'w';
+	if (m & S_IXUSR) mode[3] = 'x';
+	if (m & S_IRGRP) mode[4] = 'r';
+	if (m & S_IWGRP) mode[5] = 'w';
+	if (m & S_IXGRP) mode[6] = 'x';
+	if (m & S_IROTH) mode[7] = 'r';
+	if (m & S_IWOTH) mode[8] = 'w';
+	if (m & S_IXOTH) mode[9] = 'x';
+
+	if (m & S_ISUID) mode[3] = (mode[3] == 'x') ? 's' : 'S';
+	if (m & S_ISGID) mode[6] = (mode[6] == 'x') ? 's' : 'S';
+	if (m & S_ISVTX) mode[9] = (mode[9] == 'x') ? 't' : 'T';
+
+	return mode;
+}
+
+int
+filerec_cmp(const void *v1, const void *v2)
+{
+	return strcmp(((struct filerec *)v1)->path, ((struct filerec *)v2)->path);
+}
+
+/* key of the page header, when it changes all file pages are written */
+unsigned long long
+fcachekey(void)
+{
+	struct obuf ob;
+	unsigned long long h;
+
+	binit(&ob, -1, "header");
+	writeheader(&ob, "");
+	h = fnv1a(FNV1AINIT, ob.buf, ob.len);
+	bclose(&ob);
+
+	return h;
+}
+
+/* read the file cache (does not need to exist) */
+void
+fcacheload(void)
+{
+	struct filerec *fr;
+	struct stat st;
+	size_t cap = 0;
+	char *line, *next, *p;
 	FILE *fp;
 
-	if (strlcpy(tmp, fpath, sizeof(tmp)) >= sizeof(tmp))
-		errx(1, "path truncated: '%s'", fpath);
-	if (!(d = dirname(tmp)))
-		err(1, "dirname");
-	if (mkdirp(d))
+	if (!(fp = fopen(filecache, "r"))) {
+		if (errno == ENOENT)
+			return;
+		err(1, "fopen: '%s'", filecache);
+	}
+	if (fstat(fileno(fp), &st) == -1)
+		err(1, "fstat: '%s'", filecache);
+	if (!(fcachedata = malloc((size_t)st.st_size + 1)))
+		err(1, "malloc");
+	if (fread(fcachedata, 1, st.st_size, fp) != (size_t)st.st_size)
+		err(1, "fread: '%s'", filecache);
+	fclose(fp);
+	fcachedata[st.st_size] = '\0';
+
+	/* tree id and page key */
+	line = fcachedata;
+	if (!(next = strchr(line, '\n')))
+		errx(1, "%s: invalid file cache", filecache);
+	*next = '\0';
+	if (git_oid_fromstr(&fcachetree, line))
+		errx(1, "%s: invalid object id", filecache);
+	fcachehastree = 1;
+	line = next + 1;
+	if (!(next = strchr(line, '\n')))
+		errx(1, "%s: invalid file cache", filecache);
+	*next = '\0';
+	/* all pages are written again when the header changed */
+	if (strtoull(line, NULL, 16) != fcachekey())
+		return;
+
+	for (line = next + 1; *line; line = next + 1) {
+		if (!(next = strchr(line, '\n')))
+			errx(1, "%s: invalid file cache", filecache);
+		*next = '\0';
+		if (nfcacherecs == cap) {
+			cap = cap ? cap * 2 : 1024;
+			if (!(fcacherecs = reallocarray(fcacherecs, cap, sizeof(*fcacherecs))))
+				err(1, "realloc");
+		}
+		fr = &fcacherecs[nfcacherecs++];
+		fr->lc = strtoll(line, &p, 10);
+		if (*p != ' ')
+			errx(1, "%s: invalid file cache", filecache);
+		fr->size = strtoull(p + 1, &p, 10);
+		if (*p != ' ')
+			errx(1, "%s: invalid file cache", filecache);
+		fr->path = p + 1;
+	}
+	qsort(fcacherecs, nfcacherecs, sizeof(*fcacherecs), filerec_cmp);
+	fcachevalid = 1;
+}
+
+struct filerec *
+fcacheget(const char *path)
+{
+	struct filerec key = { .path = path };
+
+	if (!nfcacherecs)
+		return NULL;
+	return bsearch(&key, fcacherecs, nfcacherecs, sizeof(*fcacherecs),
+	               filerec_cmp);
+}
+
+/* first record of the file cache with a path not before path */
+size_t
+fcachebound(const char *path)
+{
+	size_t lo = 0, hi = nfcacherecs, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(fcacherecs[mid].path, path) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* record a written page for the next run */
+void
+fcacheadd(long long lc, unsigned long long size, const char *path)
+{
+	/* a line can't hold it: it is written again next time */
+	if (lc == -1 || strchr(path, '\n'))
+		return;
+	bputnum(&wfcache, lc, 0);
+	bputc(&wfcache, ' ');
+	bputnum(&wfcache, size, 0);
+	bputc(&wfcache, ' ');
+	bputs(&wfcache, path);
+	bputc(&wfcache, '\n');
+}
+
+/* remove the pages of the files in old which are not in new */
+void
+removefilestree(git_tree *old, git_tree *new, const char *path)
+{
+	const git_tree_entry *entry, *newentry;
+	git_object *obj, *newobj;
+	char entrypath[PATH_MAX], filepath[PATH_MAX];
+	const char *entryname;
+	size_t count, i;
+	int r;
+
+	count = git_tree_entrycount(old);
+	for (i = 0; i < count; i++) {
+		if (!(entry = git_tree_entry_byindex(old, i)) ||
+		    !(entryname = git_tree_entry_name(entry)))
+			continue;
+		newentry = new ? git_tree_entry_byname(new, entryname) : NULL;
+		/* unchanged file or directory */
+		if (newentry && !git_oid_cmp(git_tree_entry_id(entry),
+		                             git_tree_entry_id(newentry)))
+			continue;
+		joinpath(entrypath, sizeof(entrypath), path, entryname);
+
+		if (git_tree_entry_type(entry) == GIT_OBJ_TREE) {
+			if (git_tree_entry_to_object(&obj, repo, entry))
+				continue;
+			newobj = NULL;
+			if (newentry && git_tree_entry_type(newentry) == GIT_OBJ_TREE)
+				git_tree_entry_to_object(&newobj, repo, newentry);
+			removefilestree((git_tree *)obj, (git_tree *)newobj, entrypath);
+			if (!newobj) {
+				joinpath(filepath, sizeof(filepath), "file", entrypath);
+				rmdir(filepath); /* only when empty */
+			}
+			git_object_free(newobj);
+			git_object_free(obj);
+		} else if (git_tree_entry_type(entry) == GIT_OBJ_BLOB &&
+		           (!newentry || git_tree_entry_type(newentry) != GIT_OBJ_BLOB)) {
+			r = snprintf(filepath, sizeof(filepath), "file/%s.html",
+			             entrypath);
+			if (r < 0 || (size_t)r >= sizeof(filepath))
+				errx(1, "path truncated: 'file/%s.html'", entrypath);
+			if (unlink(filepath) == -1) {
+				if (errno != ENOENT)
+					err(1, "unlink: '%s'", filepath);
+			} else if (manifest) {
+				manifestadd(filepath, 'D', 0, 0);
+			}
+		}
+	}
+}
+
+size_t
+blobpagehash(const git_oid *id, int depth, const char *name)
+{
+	size_t h;
+
+	memcpy(&h, id->id, sizeof(h));
+	for (h ^= depth; *name; name++)
+		h = h * 31 + (unsigned char)*name;
+	return h;
+}
+
+/* entry with the page of the same content, returns -1 if none */
+long long
+blobpageget(const git_oid *id, int depth, const char *name)
+{
+	struct blobpage *bp;
+	size_t i, mask;
+
+	if (!capblobpages)
+		return -1;
+	mask = capblobpages - 1;
+	for (i = blobpagehash(id, depth, name) & mask; blobpages[i].entry;
+	     i = (i + 1) & mask) {
+		bp = &blobpages[i];
+		if (bp->depth == depth && !git_oid_cmp(&(bp->id), id) &&
+		    !strcmp(bp->name, name))
+			return bp->entry - 1;
+	}
+	return -1;
+}
+
+void
+blobpageadd(const git_oid *id, int depth, const char *name, size_t entry)
+{
+	struct blobpage *old, *bp;
+	size_t i, j, mask, oldcap;
+
+	/* keep the table at most half full */
+	if ((nblobpages + 1) * 2 > capblobpages) {
+		old = blobpages;
+		oldcap = capblobpages;
+		capblobpages = capblobpages ? capblobpages * 2 : 1024;
+		if (!(blobpages = calloc(capblobpages, sizeof(*blobpages))))
+			err(1, "calloc");
+		mask = capblobpages - 1;
+		for (i = 0; i < oldcap; i++) {
+			if (!old[i].entry)
+				continue;
+			for (j = blobpagehash(&(old[i].id), old[i].depth, old[i].name) & mask;
+			     blobpages[j].entry; j = (j + 1) & mask)
+				;
+			blobpages[j] = old[i];
+		}
+		free(old);
+	}
+	mask = capblobpages - 1;
+	for (i = blobpagehash(id, depth, name) & mask; blobpages[i].entry;
+	     i = (i + 1) & mask)
+		;
+	bp = &blobpages[i];
+	bp->id = *id;
+	bp->depth = depth;
+	bp->name = name;
+	bp->entry = entry + 1;
+	nblobpages++;
+}
+
+/* write the page as a hard link of a page with the same content, it
+   replaces the page atomically */
+int
+linkblob(const char *src, const char *dst)
+{
+	static unsigned long long ntmp;
+	struct stat sst, dstst;
+	const char *srcbase, *dstbase;
+	char tmp[64];
+	int sfd, dfd, scached, dcached, exists, r = -1;
+
+	if ((sfd = diropen(src, &srcbase, &scached)) == -1)
 		return -1;
+	if ((dfd = diropen(dst, &dstbase, &dcached)) != -1) {
+		exists = !fstatat(dfd, dstbase, &dstst, 0);
+		if (exists && !fstatat(sfd, srcbase, &sst, 0) &&
+		    sst.st_dev == dstst.st_dev && sst.st_ino == dstst.st_ino) {
+			r = 0; /* linked in the last run */
+		} else {
+			snprintf(tmp, sizeof(tmp), ".stagit.%ld.l%llu", (long)getpid(),
+			         __atomic_fetch_add(&ntmp, 1, __ATOMIC_RELAXED));
+			if (!(r = linkat(sfd, srcbase, dfd, tmp, 0)) &&
+			    (r = renameat(dfd, tmp, dfd, dstbase)) == -1)
+				unlinkat(dfd, tmp, 0);
+			if (!r)
+				manifestfile(dfd, dstbase, dst, exists ? 'M' : 'A');
+		}
+		if (!dcached)
+			close(dfd);
+	}
+	if (!scached)
+		close(sfd);
+
+	return r;
+}
+
+void
+filepagepath(char *buf, size_t bufsiz, const struct fileentry *fe)
+{
+	int r;
+
+	r = snprintf(buf, bufsiz, "file/%s.html", fe->path);
+	if (r < 0 || (size_t)r >= bufsiz)
+		errx(1, "path truncated: 'file/%s.html'", fe->path);
+}
+
+/* the page of file n is kept with the record fr, linked to a page of the
+   same blob or written */
+void
+filepage(size_t n, const struct filerec *fr)
+{
+	struct fileentry *fe = &files[n];
+	long long src;
+
+	if (fr) {
+		fe->page = PAGEKEPT;
+		fe->lc = fr->lc;
+		fe->size = fr->size;
+	} else if ((src = blobpageget(&(fe->id), fe->depth,
+	                              fe->path + fe->namepos)) != -1) {
+		fe->page = PAGELINK;
+		fe->src = src;
+		return;
+	} else {
+		fe->page = PAGEWRITE;
+	}
+	blobpageadd(&(fe->id), fe->depth, fe->path + fe->namepos, n);
+}
+
+int
+fileindex_cmp(const void *v1, const void *v2)
+{
+	return strcmp(files[*(const size_t *)v1].path,
+	              files[*(const size_t *)v2].path);
+}
+
+/* the pages of the files of the unchanged directory path, from start in
+   files on, are kept: its records are the range of the file cache with the
+   prefix "path/", merged in path order */
+void
+keepfiles(size_t start, const char *path)
+{
+	char prefix[PATH_MAX];
+	size_t *idx, nidx = 0, i, r, end;
+	int c;
+
+	if (!(idx = reallocarray(NULL, nfiles - start + 1, sizeof(*idx))))
+		err(1, "realloc");
+	for (i = start; i < nfiles; i++)
+		if (files[i].type == GIT_OBJ_BLOB)
+			idx[nidx++] = i;
+	qsort(idx, nidx, sizeof(*idx), fileindex_cmp);
+
+	/* "path0" is the first path after the ones in the directory */
+	joinpath(prefix, sizeof(prefix), path, "");
+	r = fcachebound(prefix);
+	prefix[strlen(prefix) - 1] = '0';
+	end = fcachebound(prefix);
+
+	for (i = 0; i < nidx; i++) {
+		for (c = 1; r < end &&
+		     (c = strcmp(fcacherecs[r].path, files[idx[i]].path)) < 0; r++)
+			;
+		filepage(idx[i], c ? NULL : &fcacherecs[r]);
+	}
+	free(idx);
+}
+
+/* collect the entries of tree, old is the tree of the last run. The pages
+   of the files of an unchanged directory are decided by keepfiles() for
+   all of it, after its entries are collected with same set. */
+int
+collectfiles(git_tree *tree, git_tree *old, const char *path, int depth,
+             int same)
+{
+	const git_tree_entry *entry, *oldentry;
+	git_object *obj, *oldobj;
+	struct fileentry *fe;
+	struct filerec *fr;
+	const char *entryname;
+	char entrypath[PATH_MAX];
+	size_t count, i, n;
+	int pass, ret;
+
+	count = git_tree_entrycount(tree);
+	/* directories first, each followed by its entries, then the files */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < count; i++) {
+			if (!(entry = git_tree_entry_byindex(tree, i)) ||
+			    !(entryname = git_tree_entry_name(entry)))
+				return -1;
+			if ((git_tree_entry_type(entry) == GIT_OBJ_TREE) != !pass)
+				continue;
+
+			joinpath(entrypath, sizeof(entrypath), path, entryname);
+			if (nfiles == capfiles) {
+				capfiles = capfiles ? capfiles * 2 : 1024;
+				if (!(files = reallocarray(files, capfiles, sizeof(*files))))
+					err(1, "realloc");
+			}
+			n = nfiles++;
+			fe = &files[n];
+			memset(fe, 0, sizeof(*fe));
+			if (!(fe->path = strdup(entrypath)))
+				err(1, "strdup");
+			fe->namepos = strlen(entrypath) - strlen(entryname);
+			fe->depth = depth;
+			fe->type = git_tree_entry_type(entry);
+			fe->mode = git_tree_entry_filemode(entry);
+			fe->id = *git_tree_entry_id(entry);
+			fe->lc = -1;
+			entryname = fe->path + fe->namepos;
+
+			if (same) {
+				if (fe->type == GIT_OBJ_TREE) {
+					if (git_tree_entry_to_object(&obj, repo, entry))
+						continue;
+					ret = collectfiles((git_tree *)obj, NULL,
+					                   entrypath, depth + 1, 1);
+					git_object_free(obj);
+					if (ret)
+						return ret;
+				}
+				continue;
+			}
 
-	for (p = fpath, tmp[0] = '\0'; *p; p++) {
-		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
-			errx(1, "path truncated: '../%s'", tmp);
+			oldentry = old ? git_tree_entry_byname(old, entryname) : NULL;
+			if (fe->type == GIT_OBJ_TREE) {
+				if (git_tree_entry_to_object(&obj, repo, entry))
+					continue;
+				/* an unchanged directory is not compared with the
+				   old tree file by file */
+				if (oldentry && git_tree_entry_type(oldentry) == GIT_OBJ_TREE &&
+				    !git_oid_cmp(git_tree_entry_id(oldentry), &(fe->id))) {
+					ret = collectfiles((git_tree *)obj, NULL,
+					                   entrypath, depth + 1, 1);
+					if (!ret)
+						keepfiles(n + 1, entrypath);
+					git_object_free(obj);
+					if (ret)
+						return ret;
+					continue;
+				}
+				oldobj = NULL;
+				if (oldentry && git_tree_entry_type(oldentry) == GIT_OBJ_TREE)
+					git_tree_entry_to_object(&oldobj, repo, oldentry);
+				ret = collectfiles((git_tree *)obj, (git_tree *)oldobj,
+				                   entrypath, depth + 1, 0);
+				git_object_free(oldobj);
+				git_object_free(obj);
+				if (ret)
+					return ret;
+			} else if (fe->type == GIT_OBJ_BLOB) {
+				/* the page of an unchanged file is kept */
+				fr = NULL;
+				if (oldentry && !git_oid_cmp(git_tree_entry_id(oldentry), &(fe->id)))
+					fr = fcacheget(entrypath);
+				filepage(n, fr);
+			}
+		}
 	}
-	relpath = tmp;
 
-	fp = efopen(fpath, "w");
-	writeheader(fp, filename);
-	fputs("<p class=\"filename\"> ", fp);
-	xmlencode(fp, filename, strlen(filename));
-	fprintf(fp, " (%juB)", (uintmax_t)filesize);
-	fputs("</p>", fp);
+	return 0;
+}
 
+/* write the page of a file, the blob is looked up in the repository of the
+   thread */
+void
+writefileentry(struct fileentry *fe)
+{
+	git_object *obj;
+	char filepath[PATH_MAX];
 
-    if (git_blob_is_binary((git_blob *)obj)) {
-        fputs("<p class=\"binary-file\">Binary file.</p>\n", fp);
-    } else {
-#ifdef WITH_MD4C
-        /* README.md など Markdown なら md4c で HTML 描画 */
-        if (is_markdown_filename(filename)) {
-            const char *s = git_blob_rawcontent((git_blob *)obj);
-            git_off_t len = git_blob_rawsize((git_blob *)obj);
-            /* お好みでラッパー要素を追加（CSS: .markdown-body を当てやすく） */
-            fputs("<section class=\"panel markdown-body\">\n", fp);
-            if (render_markdown_with_links(fp, s, (size_t)len) != 0) {
-                /* 失敗時は従来のプレーン表示へフォールバック */
-                fputs("</section>\n", fp);
-                lc = writeblobhtml(fp, (git_blob *)obj, filename);
-            } else {
-                fputs("\n</section>\n", fp);
-                lc = 0; /* 行番号を出していないので 0 扱い */
-            }
-        } else
-#endif
-        {
-            lc = writeblobhtml(fp, (git_blob *)obj, filename);
-        }
-        if (ferror(fp))
-            err(1, "fwrite");
-    }
+	if (git_object_lookup(&obj, repo, &(fe->id), GIT_OBJ_BLOB)) {
+		fe->page = PAGENONE;
+		return;
+	}
+	filepagepath(filepath, sizeof(filepath), fe);
+	fe->size = git_blob_rawsize((git_blob *)obj);
+	fe->lc = writeblob(obj, filepath, fe->path + fe->namepos, fe->size);
+	git_object_free(obj);
+}
 
-	writefooter(fp);
-	fclose(fp);
+int
+filepending(void)
+{
+	int r;
 
-	relpath = "";
+	pthread_mutex_lock(&filelock);
+	r = nextfilejob < nfilejobs;
+	pthread_mutex_unlock(&filelock);
 
-	return lc;
+	return r;
 }
 
-const char *
-filemode(git_filemode_t m)
+void *
+fileworker(void *arg)
 {
-	static char mode[11];
+	size_t i, n;
+	int shared = jobshared(arg);
 
-	memset(mode, '-', sizeof(mode) - 1);
-	mode[10] = '\0';
+	if (git_repository_open_ext(&repo, repodir,
+		GIT_REPOSITORY_OPEN_NO_SEARCH, NULL) < 0)
+		errx(1, "%s: cannot open repository", repodir);
+	if (useuring)
+		buringopen();
 
-	if (S_ISREG(m))
-		mode[0] = '-';
-	else if (S_ISBLK(m))
-		mode[0] = 'b';
-	else if (S_ISCHR(m))
-		mode[0] = 'c';
-	else if (S_ISDIR(m))
-		mode[0] = 'd';
-	else if (S_ISFIFO(m))
-		mode[0] = 'p';
-	else if (S_ISLNK(m))
-		mode[0] = 'l';
-	else if (S_ISSOCK(m))
-		mode[0] = 's';
-	else
-		mode[0] = '?';
+	for (n = FILEBATCH; n == FILEBATCH; ) {
+		if (shared && !jobtake(filepending))
+			break;
+		for (n = 0; n < FILEBATCH; n++) {
+			pthread_mutex_lock(&filelock);
+			i = nextfilejob++;
+			pthread_mutex_unlock(&filelock);
+			if (i >= nfilejobs)
+				break;
+			writefileentry(&files[filejobs[i]]);
+		}
+		if (shared)
+			jobgive();
+	}
+	buringclose();
+	git_repository_free(repo);
+	repo = NULL;
 
-	if (m & S_IRUSR) mode[1] = 'r';
-	if (m & S_IWUSR) mode[2] = 'w';
-	if (m & S_IXUSR) mode[3] = 'x';
-	if (m & S_IRGRP) mode[4] = 'r';
-	if (m & S_IWGRP) mode[5] = 'w';
-	if (m & S_IXGRP) mode[6] = 'x';
-	if (m & S_IROTH) mode[7] = 'r';
-	if (m & S_IWOTH) mode[8] = 'w';
-	if (m & S_IXOTH) mode[9] = 'x';
+	return NULL;
+}
 
-	if (m & S_ISUID) mode[3] = (mode[3] == 'x') ? 's' : 'S';
-	if (m & S_ISGID) mode[6] = (mode[6] == 'x') ? 's' : 'S';
-	if (m & S_ISVTX) mode[9] = (mode[9] == 'x') ? 't' : 'T';
+/* write the pages of the collected files, on the worker threads */
+void
+writefilepages(void)
+{
+	pthread_t *threads;
+	size_t i, n;
+	int r;
 
-	return mode;
+	if (!(filejobs = reallocarray(NULL, nfiles + 1, sizeof(*filejobs))))
+		err(1, "realloc");
+	for (i = 0; i < nfiles; i++)
+		if (files[i].page == PAGEWRITE)
+			filejobs[nfilejobs++] = i;
+
+	if (nthreads <= 1 || nfilejobs <= 1) {
+		for (i = 0; i < nfilejobs; i++)
+			writefileentry(&files[filejobs[i]]);
+		/* the pages are linked to by the rows */
+		buringsync();
+	} else {
+		n = nthreads < (long long)nfilejobs ? (size_t)nthreads : nfilejobs;
+		if (!(threads = calloc(n, sizeof(*threads))))
+			err(1, "calloc");
+		nextfilejob = 0;
+		for (i = 0; i < n; i++)
+			if ((r = pthread_create(&threads[i], NULL, fileworker, (void *)(intptr_t)i)))
+				errx(1, "pthread_create: %s", strerror(r));
+		for (i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
+	free(filejobs);
+	filejobs = NULL;
+	nfilejobs = nextfilejob = 0;
 }
 
-int
-writefilestree(FILE *fp, git_tree *tree, const char *path)
+void
+printtreerow(struct obuf *ob, const char *class, const struct fileentry *fe)
 {
-	const git_tree_entry *entry = NULL;
-	git_object *obj = NULL;
-	git_off_t filesize;
+	bputs(ob, "<tr class=\"");
+	bputs(ob, class);
+	bputs(ob, "\" data-path=\"");
+	bputs(ob, fe->path);
+	bputs(ob, "\" data-parent=\"");
+	bwrite(ob, fe->path, fe->namepos ? fe->namepos - 1 : 0);
+	bputs(ob, "\" data-depth=\"");
+	bputnum(ob, fe->depth, 0);
+	bputs(ob, "\">");
+}
+
+/* write the rows of the collected files, in order */
+void
+writefilesrows(struct obuf *ob)
+{
+	struct fileentry *fe, *src;
 	const char *entryname;
-	char filepath[PATH_MAX], entrypath[PATH_MAX];
-	size_t count, i;
-	int lc, r, ret;
-	int depth = 0;
-	const char *p;
+	char filepath[PATH_MAX], srcpath[PATH_MAX];
+	size_t i;
+	int d;
 
-	/* Calculate depth from path - entries in this directory */
-	if (*path) {
-		depth = 1;
-		for (p = path; *p; p++)
-			if (*p == '/') depth++;
-	}
+	for (i = 0; i < nfiles; i++) {
+		fe = &files[i];
+		entryname = fe->path + fe->namepos;
 
-	count = git_tree_entrycount(tree);
-	
-	/* First pass: directories */
-	for (i = 0; i < count; i++) {
-		if (!(entry = git_tree_entry_byindex(tree, i)) ||
-		    !(entryname = git_tree_entry_name(entry)))
-			return -1;
+		if (fe->type == GIT_OBJ_TREE) {
+			/* Directory row */
+			printtreerow(ob, "dir-row", fe);
+			bputs(ob, "<td>");
 			
-		if (git_tree_entry_type(entry) != GIT_OBJ_TREE)
-			continue;
+			/* Indentation */
+			for (d = 0; d < fe->depth; d++)
+				bputs(ob, "<span class=\"tree-indent\"></span>");
 			
-		joinpath(entrypath, sizeof(entrypath), path, entryname);
-		
-		/* Directory row */
-		fprintf(fp, "<tr class=\"dir-row\" data-path=\"%s\" data-parent=\"%s\" data-depth=\"%d\">", 
-		        entrypath, path, depth);
-		fputs("<td>", fp);
-		
-		/* Indentation */
-		for (int d = 0; d < depth; d++)
-			fputs("<span class=\"tree-indent\"></span>", fp);
-		
-		/* Toggle icon */
-		fputs("<span class=\"dir-toggle\">▸</span>", fp);
-		printfileicon(fp, entryname, 1);
-		fputs("<span class=\"dirname-clickable\">", fp);
-		xmlencode(fp, entryname, strlen(entryname));
-		fputs("/</span>", fp);
-		
-		fputs("</td><td>d---------</td><td class=\"num\" align=\"right\">-</td></tr>\n", fp);
-		
-		/* Recursively write directory contents */
-		if (!git_tree_entry_to_object(&obj, repo, entry)) {
-			ret = writefilestree(fp, (git_tree *)obj, entrypath);
-			git_object_free(obj);
-			if (ret)
-				return ret;
-		}
-	}
-	
-	/* Second pass: files */
-	for (i = 0; i < count; i++) {
-		if (!(entry = git_tree_entry_byindex(tree, i)) ||
-		    !(entryname = git_tree_entry_name(entry)))
-			return -1;
-		joinpath(entrypath, sizeof(entrypath), path, entryname);
-
-		r = snprintf(filepath, sizeof(filepath), "file/%s.html",
-		         entrypath);
-		if (r < 0 || (size_t)r >= sizeof(filepath))
-			errx(1, "path truncated: 'file/%s.html'", entrypath);
-
-		if (git_tree_entry_type(entry) == GIT_OBJ_TREE)
-			continue; /* Already handled in first pass */
+			/* Toggle icon */
+			bputs(ob, "<span class=\"dir-toggle\">▸</span>");
+			printfileicon(ob, entryname, 1);
+			bputs(ob, "<span class=\"dirname-clickable\">");
+			xmlencode(ob, entryname, strlen(entryname));
+			bputs(ob, "/</span>");
 			
-		if (!git_tree_entry_to_object(&obj, repo, entry)) {
-			if (git_object_type(obj) != GIT_OBJ_BLOB) {
-				git_object_free(obj);
-				continue;
+			bputs(ob, "</td><td>d---------</td><td class=\"num\" align=\"right\">-</td></tr>\n");
+		} else if (fe->type == GIT_OBJ_BLOB) {
+			filepagepath(filepath, sizeof(filepath), fe);
+			if (fe->page == PAGELINK) {
+				src = &files[fe->src];
+				filepagepath(srcpath, sizeof(srcpath), src);
+				if (src->page != PAGENONE && src->lc != -1 &&
+				    !linkblob(srcpath, filepath)) {
+					fe->lc = src->lc;
+					fe->size = src->size;
+				} else {
+					fe->page = PAGEWRITE;
+					writefileentry(fe);
+				}
 			}
-
-			filesize = git_blob_rawsize((git_blob *)obj);
-			lc = writeblob(obj, filepath, entryname, filesize);
-
-			fprintf(fp, "<tr class=\"file-row\" data-path=\"%s\" data-parent=\"%s\" data-depth=\"%d\">",
-			        entrypath, path, depth);
-			fputs("<td><a href=\"", fp);
-			fprintf(fp, "%s", relpath);
-			xmlencode(fp, filepath, strlen(filepath));
-			fputs("\">", fp);
+			if (fe->page == PAGENONE)
+				continue;
+			if (fe->page == PAGEWRITE)
+				nfileswritten++;
+			else if (fe->page == PAGELINK)
+				nfileslinked++;
+			else
+				nfileskept++;
+			if (filecache)
+				fcacheadd(fe->lc, fe->size, fe->path);
+
+			printtreerow(ob, "file-row", fe);
+			bputs(ob, "<td><a href=\"");
+			bputs(ob, relpath);
+			xmlencode(ob, filepath, strlen(filepath));
+			bputs(ob, "\">");
 			
 			/* Indentation */
-			for (int d = 0; d < depth; d++)
-				fputs("<span class=\"tree-indent\"></span>", fp);
+			for (d = 0; d < fe->depth; d++)
+				bputs(ob, "<span class=\"tree-indent\"></span>");
 			
-			printfileicon(fp, entryname, 0);
-			xmlencode(fp, entryname, strlen(entryname));
-			fputs("</a></td><td>", fp);
-			fputs(filemode(git_tree_entry_filemode(entry)), fp);
+			printfileicon(ob, entryname, 0);
+			xmlencode(ob, entryname, strlen(entryname));
+			bputs(ob, "</a></td><td>");
+			bputs(ob, filemode(fe->mode));
 			
-			fputs("</td><td class=\"num\" align=\"right\">", fp);
-			if (lc > 0)
-				fprintf(fp, "%dL", lc);
-			else
-				fprintf(fp, "%juB", (uintmax_t)filesize);
-			fputs("</td></tr>\n", fp);
-			git_object_free(obj);
-		} else if (git_tree_entry_type(entry) == GIT_OBJ_COMMIT) {
+			bputs(ob, "</td><td class=\"num\" align=\"right\">");
+			if (fe->lc > 0) {
+				bputnum(ob, fe->lc, 0);
+				bputc(ob, 'L');
+			} else {
+				bputnum(ob, fe->size, 0);
+				bputc(ob, 'B');
+			}
+			bputs(ob, "</td></tr>\n");
+		} else if (fe->type == GIT_OBJ_COMMIT) {
 			/* commit object in tree is a submodule */
-			fprintf(fp, "<tr class=\"file-row\" data-path=\"%s\" data-parent=\"%s\" data-depth=\"%d\">",
-			        entrypath, path, depth);
-			fprintf(fp, "<td><a href=\"%sfile/.gitmodules.html\">",
+			printtreerow(ob, "file-row", fe);
+			bprintf(ob, "<td><a href=\"%sfile/.gitmodules.html\">",
 				relpath);
 			
 			/* Indentation */
-			for (int d = 0; d < depth; d++)
-				fputs("<span class=\"tree-indent\"></span>", fp);
+			for (d = 0; d < fe->depth; d++)
+				bputs(ob, "<span class=\"tree-indent\"></span>");
 			
-			printfileicon(fp, entryname, 0);
-			xmlencode(fp, entryname, strlen(entryname));
-			fputs("</a></td><td>m---------</td><td class=\"num\" align=\"right\">@</td></tr>\n", fp);
+			printfileicon(ob, entryname, 0);
+			xmlencode(ob, entryname, strlen(entryname));
+			bputs(ob, "</a></td><td>m---------</td><td class=\"num\" align=\"right\">@</td></tr>\n");
 		}
 	}
+}
 
-	return 0;
+void
+filesfree(void)
+{
+	size_t i;
+
+	for (i = 0; i < nfiles; i++)
+		free(files[i].path);
+	free(files);
+	files = NULL;
+	nfiles = capfiles = 0;
+	free(blobpages);
+	blobpages = NULL;
+	nblobpages = capblobpages = 0;
 }
 
 int
-writefiles(FILE *fp, const git_oid *id)
+writefiles(struct obuf *ob, const git_oid *id)
 {
-	git_tree *tree = NULL;
+	git_tree *tree = NULL, *old = NULL;
 	git_commit *commit = NULL;
+	char oidstr[GIT_OID_HEXSZ + 1];
 	int ret = -1;
 
 	/* File search box */
-	fputs("<div class=\"file-search\">\n", fp);
-	fputs("<input type=\"search\" id=\"file-search\" placeholder=\"Find file...\" aria-label=\"Search files\" />\n", fp);
-	fputs("</div>\n", fp);
+	bputs(ob, "<div class=\"file-search\">\n");
+	bputs(ob, "<input type=\"search\" id=\"file-search\" placeholder=\"Find file...\" aria-label=\"Search files\" />\n");
+	bputs(ob, "</div>\n");
 	
-	fputs("<table id=\"files\"><thead>\n<tr>"
-	      "<td><b>Name</b></td><td><b>Mode</b></td>"
-	      "<td class=\"num\" align=\"right\"><b>Size</b></td>"
-	      "</tr>\n</thead><tbody>\n", fp);
+	bputs(ob, "<table id=\"files\"><thead>\n<tr>"
+	          "<td><b>Name</b></td><td><b>Mode</b></td>"
+	          "<td class=\"num\" align=\"right\"><b>Size</b></td>"
+	          "</tr>\n</thead><tbody>\n");
 
 	if (!git_commit_lookup(&commit, repo, id) &&
-	    !git_commit_tree(&tree, commit))
-		ret = writefilestree(fp, tree, "");
+	    !git_commit_tree(&tree, commit)) {
+		if (filecache) {
+			/* tree of the last run */
+			if (fcachehastree && git_tree_lookup(&old, repo, &fcachetree))
+				old = NULL;
+			git_oid_tostr(oidstr, sizeof(oidstr), git_tree_id(tree));
+			bprintf(&wfcache, "%s\n%llx\n", oidstr, fcachekey());
+		}
+		/* its pages are kept if the header did not change */
+		ret = collectfiles(tree, fcachevalid ? old : NULL, "", 0, 0);
+		filescomplete = !ret;
+		writefilepages();
+		writefilesrows(ob);
+		dirsfree();
+		if (!ret && old)
+			removefilestree(old, tree, "");
+	}
 
-	fputs("</tbody></table>", fp);
+	bputs(ob, "</tbody></table>");
 	
 	/* File tree and search scripts */
-	fputs("<script>\n"
+	bputs(ob, "<script>\n"
 		"/* Directory toggle functionality */\n"
 		"(function(){\n"
 		"  var dirRows=document.querySelectorAll('.dir-row');\n"
@@ -1471,16 +3468,17 @@ writefiles(FILE *fp, const git_oid *id)
 		"    }\n"
 		"  });\n"
 		"})();\n"
-		"</script>\n", fp);
+		"</script>\n");
 
 	git_commit_free(commit);
+	git_tree_free(old);
 	git_tree_free(tree);
 
 	return ret;
 }
 
 int
-writerefs(FILE *fp)
+writerefs(struct obuf *ob)
 {
 	struct referenceinfo *ris = NULL;
 	struct commitinfo *ci;
@@ -1495,14 +3493,14 @@ writerefs(FILE *fp)
 	for (i = 0, j = 0, count = 0; i < refcount; i++) {
 		if (j == 0 && git_reference_is_tag(ris[i].ref)) {
 			if (count)
-				fputs("</tbody></table><br/>\n", fp);
+				bputs(ob, "</tbody></table><br/>\n");
 			count = 0;
 			j = 1;
 		}
 
 		/* print header if it has an entry (first). */
 		if (++count == 1) {
-			fprintf(fp, "<h2>%s</h2><table id=\"%s\">"
+			bprintf(ob, "<h2>%s</h2><table id=\"%s\">"
 		                "<thead>\n<tr><td><b>Name</b></td>"
 			        "<td><b>Last commit date</b></td>"
 			        "<td><b>Author</b></td>\n</tr>\n"
@@ -1513,19 +3511,19 @@ writerefs(FILE *fp)
 		ci = ris[i].ci;
 		s = git_reference_shorthand(ris[i].ref);
 
-		fputs("<tr><td>", fp);
-		xmlencode(fp, s, strlen(s));
-		fputs("</td><td>", fp);
+		bputs(ob, "<tr><td>");
+		xmlencode(ob, s, strlen(s));
+		bputs(ob, "</td><td>");
 		if (ci->author)
-			printtimeshort(fp, &(ci->author->when));
-		fputs("</td><td>", fp);
+			printtimeshort(ob, &(ci->author->when));
+		bputs(ob, "</td><td>");
 		if (ci->author)
-			xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs("</td></tr>\n", fp);
+			xmlencode(ob, ci->author->name, strlen(ci->author->name));
+		bputs(ob, "</td></tr>\n");
 	}
 	/* table footer */
 	if (count)
-		fputs("</tbody></table><br/>\n", fp);
+		bputs(ob, "</tbody></table><br/>\n");
 
 	for (i = 0; i < refcount; i++) {
 		commitinfo_free(ris[i].ci);
@@ -1536,94 +3534,310 @@ writerefs(FILE *fp)
 	return 0;
 }
 
+/* remove the orphaned file name in dirfd, path is relative to the current
+   directory */
 void
-usage(char *argv0)
+gcremove(int dirfd, const char *name, const char *path)
 {
-	fprintf(stderr, "%s [-c cachefile | -l commits] repodir\n", argv0);
-	exit(1);
+	struct stat st;
+
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    !S_ISREG(st.st_mode))
+		return;
+	if (unlinkat(dirfd, name, 0) == -1)
+		err(1, "unlink: '%s'", path);
+	ngcfiles++;
+	ngcbytes += st.st_size;
+	if (manifest)
+		manifestadd(path, 'D', 0, 0);
 }
 
+/* a temporary file left by an interrupted run */
 int
-main(int argc, char *argv[])
+gcistmp(const char *name)
 {
-	git_object *obj = NULL;
-	const git_oid *head = NULL;
-	mode_t mask;
-	FILE *fp, *fpread;
-	char path[PATH_MAX], repodirabs[PATH_MAX + 1], *p;
-	char tmppath[64] = "cache.XXXXXXXXXXXX", buf[BUFSIZ];
-	size_t n;
-	int i, fd;
+	return !strncmp(name, ".stagit.", 8) && strcmp(name, LOCKFILE);
+}
 
-	for (i = 1; i < argc; i++) {
-		if (argv[i][0] != '-') {
-			if (repodir)
-				usage(argv[0]);
-			repodir = argv[i];
-		} else if (argv[i][1] == 'c') {
-			if (nlogcommits > 0 || i + 1 >= argc)
-				usage(argv[0]);
-			cachefile = argv[++i];
-		} else if (argv[i][1] == 'l') {
-			if (cachefile || i + 1 >= argc)
-				usage(argv[0]);
-			errno = 0;
-			nlogcommits = strtoll(argv[++i], &p, 10);
-			if (argv[i][0] == '\0' || *p != '\0' ||
-			    nlogcommits <= 0 || errno)
-				usage(argv[0]);
+/* index the entries of files by path, for gcfiletype() */
+void
+gcfilesindex(void)
+{
+	size_t i, j, mask;
+
+	for (capfilesbypath = 64; capfilesbypath < nfiles * 2; capfilesbypath *= 2)
+		;
+	if (!(filesbypath = calloc(capfilesbypath, sizeof(*filesbypath))))
+		err(1, "calloc");
+	mask = capfilesbypath - 1;
+	for (i = 0; i < nfiles; i++) {
+		for (j = fnv1a(FNV1AINIT, files[i].path, strlen(files[i].path)) & mask;
+		     filesbypath[j]; j = (j + 1) & mask)
+			;
+		filesbypath[j] = i + 1;
+	}
+}
+
+/* type of the entry path in the tree of HEAD or -1 */
+int
+gcfiletype(const char *path)
+{
+	size_t j, mask = capfilesbypath - 1;
+
+	for (j = fnv1a(FNV1AINIT, path, strlen(path)) & mask; filesbypath[j];
+	     j = (j + 1) & mask)
+		if (!strcmp(files[filesbypath[j] - 1].path, path))
+			return files[filesbypath[j] - 1].type;
+	return -1;
+}
+
+/* remove the pages in the directory name in dirfd, path in file/, of which
+   the file is not in the tree of HEAD, and the directories which are not in
+   it when they are empty */
+void
+gcfiles(int dirfd, const char *name, const char *path)
+{
+	struct stat st;
+	struct dirent *d;
+	DIR *dp;
+	char entrypath[PATH_MAX], filepath[PATH_MAX];
+	size_t len;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY)) == -1)
+		return;
+	if (!(dp = fdopendir(fd)))
+		err(1, "fdopendir: 'file/%s'", path);
+	while ((d = readdir(dp))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			continue;
+		joinpath(entrypath, sizeof(entrypath), path, d->d_name);
+		if (S_ISDIR(st.st_mode)) {
+			gcfiles(fd, d->d_name, entrypath);
+			if (gcfiletype(entrypath) != GIT_OBJ_TREE)
+				unlinkat(fd, d->d_name, AT_REMOVEDIR); /* only when empty */
+			continue;
 		}
+		/* file/path.html is the page of the blob path */
+		len = strlen(entrypath);
+		if (len > 5 && !strcmp(entrypath + len - 5, ".html")) {
+			entrypath[len - 5] = '\0';
+			if (gcfiletype(entrypath) == GIT_OBJ_BLOB)
+				continue;
+			entrypath[len - 5] = '.';
+		}
+		joinpath(filepath, sizeof(filepath), "file", entrypath);
+		gcremove(fd, d->d_name, filepath);
 	}
-	if (!repodir)
-		usage(argv[0]);
+	closedir(dp);
+}
 
-	if (!realpath(repodir, repodirabs))
-		err(1, "realpath");
+/* remove the pages which are not of the first-parent history or the tree of
+   HEAD, and temporary files of interrupted runs */
+void
+gcpages(const git_oid *head)
+{
+	git_revwalk *w = NULL;
+	git_oid id;
+	struct dirent *d;
+	DIR *dp;
+	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1], *end;
+	long long n;
+	size_t len;
+	int fd;
+
+	/* commits */
+	git_revwalk_new(&w, repo);
+	git_revwalk_push(w, head);
+	git_revwalk_simplify_first_parent(w);
+	while (!git_revwalk_next(&id, w))
+		oidsetadd(&gccommits, &id, 0);
+	git_revwalk_free(w);
 
-	git_libgit2_init();
+	if ((fd = open("commit", O_RDONLY | O_DIRECTORY)) != -1) {
+		if (!(dp = fdopendir(fd)))
+			err(1, "fdopendir: 'commit'");
+		while ((d = readdir(dp))) {
+			len = strlen(d->d_name);
+			snprintf(path, sizeof(path), "commit/%s", d->d_name);
+			if (len == GIT_OID_HEXSZ + 5 &&
+			    !strcmp(d->d_name + GIT_OID_HEXSZ, ".html")) {
+				memcpy(oidstr, d->d_name, GIT_OID_HEXSZ);
+				oidstr[GIT_OID_HEXSZ] = '\0';
+				if (!git_oid_fromstr(&id, oidstr) &&
+				    oidsetget(&gccommits, &id) != -1)
+					continue;
+			} else if (!gcistmp(d->d_name)) {
+				continue;
+			}
+			gcremove(fd, d->d_name, path);
+		}
+		closedir(dp);
+	}
 
-#ifdef __OpenBSD__
-	if (unveil(repodir, "r") == -1)
-		err(1, "unveil: %s", repodir);
-	if (unveil(".", "rwc") == -1)
-		err(1, "unveil: .");
-	if (cachefile && unveil(cachefile, "rwc") == -1)
-		err(1, "unveil: %s", cachefile);
+	/* files: the entries of files.html are the tree of HEAD */
+	if (filescomplete) {
+		gcfilesindex();
+		gcfiles(AT_FDCWD, "file", "");
+		free(filesbypath);
+		filesbypath = NULL;
+		capfilesbypath = 0;
+	}
 
-	if (cachefile) {
-		if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
-			err(1, "pledge");
-	} else {
-		if (pledge("stdio rpath wpath cpath", NULL) == -1)
-			err(1, "pledge");
+	/* log pages past the newest page */
+	if (logpagesize && (fd = open("log", O_RDONLY | O_DIRECTORY)) != -1) {
+		if (!(dp = fdopendir(fd)))
+			err(1, "fdopendir: 'log'");
+		while ((d = readdir(dp))) {
+			snprintf(path, sizeof(path), "log/%s", d->d_name);
+			n = strtoll(d->d_name, &end, 10);
+			if ((end != d->d_name && !strcmp(end, ".html") &&
+			     n >= nlogpages) || gcistmp(d->d_name))
+				gcremove(fd, d->d_name, path);
+		}
+		closedir(dp);
 	}
-#endif
 
-	if (git_repository_open_ext(&repo, repodir,
-		GIT_REPOSITORY_OPEN_NO_SEARCH, NULL) < 0) {
-		fprintf(stderr, "%s: cannot open repository\n", argv[0]);
-		return 1;
+	/* temporary files of the other pages */
+	if ((dp = opendir("."))) {
+		while ((d = readdir(dp)))
+			if (gcistmp(d->d_name))
+				gcremove(AT_FDCWD, d->d_name, d->d_name);
+		closedir(dp);
 	}
 
-	/* find HEAD */
-	if (!git_revparse_single(&obj, repo, "HEAD"))
-		head = git_object_id(obj);
-	git_object_free(obj);
+	free(gccommits.ents);
+	memset(&gccommits, 0, sizeof(gccommits));
+	fprintf(stderr, "gc: %zu files removed, %llu bytes\n", ngcfiles, ngcbytes);
+}
 
-	/* use directory name as name */
-	if ((name = strrchr(repodirabs, '/')))
-		name++;
-	else
-		name = "";
+/* set the pages to write for an updated ref: the log and files for the
+   branch of HEAD, refs.html for branches and tags and tags.xml for tags.
+   When the branch of HEAD was rewritten the pages which are not in its
+   history are removed as with -g. */
+void
+refupdate(const git_oid *old, const git_oid *new, const char *refname,
+          const char *headref)
+{
+	if (!strncmp(refname, "refs/tags/", strlen("refs/tags/")))
+		updates |= UPDREFS | UPDTAGS;
+	else if (!strncmp(refname, "refs/heads/", strlen("refs/heads/")))
+		updates |= UPDREFS;
+	if (!headref || strcmp(refname, headref))
+		return;
+	updates |= UPDLOG;
+	/* a rewrite: the old commit is not in the new history */
+	if (!git_oid_iszero(old) && !git_oid_iszero(new) &&
+	    git_oid_cmp(old, new) &&
+	    git_graph_descendant_of(repo, new, old) != 1) {
+		if (verbose)
+			fprintf(stderr, "%s rewritten\n", refname);
+		rewritten = 1;
+	}
+}
+
+/* read the "old new ref" lines of a post-receive hook on stdin */
+void
+readupdates(void)
+{
+	git_reference *ref;
+	git_oid old, new;
+	char line[PATH_MAX + 2 * GIT_OID_HEXSZ + 3], *headref = NULL;
+
+	if (!git_reference_lookup(&ref, repo, "HEAD")) {
+		if (git_reference_type(ref) == GIT_REF_SYMBOLIC &&
+		    !(headref = strdup(git_reference_symbolic_target(ref))))
+			err(1, "strdup");
+		git_reference_free(ref);
+	}
+
+	updates = 0;
+	while (fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strlen(line) <= 2 * GIT_OID_HEXSZ + 2 ||
+		    line[GIT_OID_HEXSZ] != ' ' || line[2 * GIT_OID_HEXSZ + 1] != ' ' ||
+		    git_oid_fromstrn(&old, line, GIT_OID_HEXSZ) ||
+		    git_oid_fromstrn(&new, line + GIT_OID_HEXSZ + 1, GIT_OID_HEXSZ))
+			errx(1, "stdin: invalid ref update: '%s'", line);
+		refupdate(&old, &new, line + 2 * GIT_OID_HEXSZ + 2, headref);
+	}
+	if (ferror(stdin))
+		err(1, "fgets: stdin");
+	free(headref);
+}
+
+void
+usage(char *argv0)
+{
+	fprintf(stderr, "%s [-v] [-c cachefile | -l commits] [-d maxdiff] "
+	        "[-f filecache] [-g] [-j jobs] [-m manifest] [-n commits] "
+	        "[-p logpage] [-r] "
+	        "[-s statsfile] [-t] [-u] [-w] repodir | -b batchfile\n", argv0);
+	exit(1);
+}
+
+/* free the state of a run, for the next run with -w */
+void
+runfree(void)
+{
+	if (statsmap)
+		munmap(statsmap, statsmaplen);
+	statsmap = NULL;
+	statsmaplen = nstats = 0;
+	free(newstats);
+	newstats = NULL;
+	nnewstats = capnewstats = 0;
+	free(fcacherecs);
+	fcacherecs = NULL;
+	nfcacherecs = 0;
+	free(fcachedata);
+	fcachedata = NULL;
+	fcachehastree = fcachevalid = 0;
+	strlcpy(fcachetmp, "files.XXXXXXXXXXXX", sizeof(fcachetmp));
+	nfileswritten = nfileslinked = nfileskept = 0;
+	nlogcached = nlogpages = 0;
+	ngcfiles = 0;
+	ngcbytes = 0;
+	rewritten = 0;
+	memset(&allocstats, 0, sizeof(allocstats));
+	/* kept for gcpages() */
+	filesfree();
+	filescomplete = 0;
+}
+
+/* write the pages of the repository, with -r and -w only the updated ones */
+void
+writerepo(void)
+{
+	git_object *obj = NULL;
+	const git_oid *head = NULL;
+	git_oid headid;
+	mode_t mask;
+	struct obuf ob;
+	FILE *fpread;
+	char path[PATH_MAX];
+	char tmppath[64] = "cache.XXXXXXXXXXXX", buf[BUFSIZ];
+	long long maxlogcommits = nlogcommits;
+	size_t n;
+	int i, fd, ret = -1;
 
-	/* strip .git suffix */
-	if (!(strippedname = strdup(name)))
-		err(1, "strdup");
-	if ((p = strrchr(strippedname, '.')))
-		if (!strcmp(p, ".git"))
-			*p = '\0';
+	/* without io_uring the pages are written as they are made */
+	if (useuring)
+		buringopen();
+
+	/* find HEAD */
+	if (!git_revparse_single(&obj, repo, "HEAD")) {
+		headid = *git_object_id(obj);
+		head = &headid;
+		if (git_object_type(obj) == GIT_OBJ_COMMIT)
+			headtime = git_commit_time((git_commit *)obj);
+	}
+	git_object_free(obj);
 
 	/* read description or .git/description */
+	description[0] = cloneurl[0] = '\0';
 	joinpath(path, sizeof(path), repodir, "description");
 	if (!(fpread = fopen(path, "r"))) {
 		joinpath(path, sizeof(path), repodir, ".git/description");
@@ -1648,46 +3862,58 @@ main(int argc, char *argv[])
 		fclose(fpread);
 	}
 
-	/* check LICENSE */
-	for (i = 0; i < sizeof(licensefiles) / sizeof(*licensefiles) && !license; i++) {
-		if (!git_revparse_single(&obj, repo, licensefiles[i]) &&
-		    git_object_type(obj) == GIT_OBJ_BLOB)
-			license = licensefiles[i] + strlen("HEAD:");
-		git_object_free(obj);
-	}
+	/* check LICENSE, README and .gitmodules, again only for a new HEAD */
+	if (!head || !probedhead || git_oid_cmp(head, &lasthead)) {
+		license = readme = submodules = NULL;
+		/* check LICENSE */
+		for (i = 0; i < sizeof(licensefiles) / sizeof(*licensefiles) && !license; i++) {
+			if (!git_revparse_single(&obj, repo, licensefiles[i]) &&
+			    git_object_type(obj) == GIT_OBJ_BLOB)
+				license = licensefiles[i] + strlen("HEAD:");
+			git_object_free(obj);
+		}
+
+		/* check README */
+		for (i = 0; i < sizeof(readmefiles) / sizeof(*readmefiles) && !readme; i++) {
+			if (!git_revparse_single(&obj, repo, readmefiles[i]) &&
+			    git_object_type(obj) == GIT_OBJ_BLOB)
+				readme = readmefiles[i] + strlen("HEAD:");
+			git_object_free(obj);
+		}
 
-	/* check README */
-	for (i = 0; i < sizeof(readmefiles) / sizeof(*readmefiles) && !readme; i++) {
-		if (!git_revparse_single(&obj, repo, readmefiles[i]) &&
+		if (!git_revparse_single(&obj, repo, "HEAD:.gitmodules") &&
 		    git_object_type(obj) == GIT_OBJ_BLOB)
-			readme = readmefiles[i] + strlen("HEAD:");
+			submodules = ".gitmodules";
 		git_object_free(obj);
+
+		if ((probedhead = head != NULL))
+			lasthead = *head;
 	}
 
-	if (!git_revparse_single(&obj, repo, "HEAD:.gitmodules") &&
-	    git_object_type(obj) == GIT_OBJ_BLOB)
-		submodules = ".gitmodules";
-	git_object_free(obj);
+	if (statsfile)
+		statsload();
 
 	/* log for HEAD */
-	fp = efopen("log.html", "w");
 	relpath = "";
+	if (!(updates & UPDLOG))
+		goto refs;
 	mkdir("commit", S_IRWXU | S_IRWXG | S_IRWXO);
-	writeheader(fp, "Log");
-	fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td>"
-	      "<td><b>Commit message</b></td>"
-	      "<td><b>Author</b></td><td class=\"num\" align=\"right\"><b>Files</b></td>"
-	      "<td class=\"num\" align=\"right\"><b>+</b></td>"
-	      "<td class=\"num\" align=\"right\"><b>-</b></td></tr>\n</thead><tbody>\n", fp);
+	if (logpagesize) {
+		writelogpages(head, tmppath);
+		goto files;
+	}
+	bopen(&ob, "log.html");
+	if (setmtime)
+		ob.mtime = headtime;
+	writeheader(&ob, "Log");
+	bputs(&ob, "<table id=\"log\"><thead>\n<tr><td><b>Date</b></td>"
+	           "<td><b>Commit message</b></td>"
+	           "<td><b>Author</b></td><td class=\"num\" align=\"right\"><b>Files</b></td>"
+	           "<td class=\"num\" align=\"right\"><b>+</b></td>"
+	           "<td class=\"num\" align=\"right\"><b>-</b></td></tr>\n</thead><tbody>\n");
 
 	if (cachefile && head) {
-		/* read from cache file (does not need to exist) */
-		if ((rcachefp = fopen(cachefile, "r"))) {
-			if (!fgets(lastoidstr, sizeof(lastoidstr), rcachefp))
-				errx(1, "%s: no object id", cachefile);
-			if (git_oid_fromstr(&lastoid, lastoidstr))
-				errx(1, "%s: invalid object id", cachefile);
-		}
+		logcacheload();
 
 		/* write log to (temporary) cache */
 		if ((fd = mkstemp(tmppath)) == -1)
@@ -1698,54 +3924,91 @@ main(int argc, char *argv[])
 		git_oid_tostr(buf, sizeof(buf), head);
 		fprintf(wcachefp, "%s\n", buf);
 
-		writelog(fp, head);
-
-		if (rcachefp) {
-			/* append previous log to log.html and the new cache */
-			while (!feof(rcachefp)) {
-				n = fread(buf, 1, sizeof(buf), rcachefp);
-				if (ferror(rcachefp))
-					err(1, "fread");
-				if (fwrite(buf, 1, n, fp) != n ||
-				    fwrite(buf, 1, n, wcachefp) != n)
-					err(1, "fwrite");
-			}
-			fclose(rcachefp);
+		writelog(&ob, head);
+
+		/* append the previous log from the commit the log stopped at to
+		   log.html and the new cache */
+		for (n = cachestop; n < ncacherows; n++) {
+			bwrite(&ob, cacherows[n].row, cacherows[n].rowlen);
+			writecacherow(wcachefp, &cacherows[n]);
 		}
+		if (fflush(wcachefp) || ferror(wcachefp))
+			err(1, "fwrite: '%s'", tmppath);
 		fclose(wcachefp);
+		logcachefree();
 	} else {
 		if (head)
-			writelog(fp, head);
+			writelog(&ob, head);
 	}
 
-	fputs("</tbody></table>", fp);
-	writefooter(fp);
-	fclose(fp);
+	bputs(&ob, "</tbody></table>");
+	writefooter(&ob);
+	bclose(&ob);
 
+files:
 	/* files for HEAD */
-	fp = efopen("files.html", "w");
-	writeheader(fp, "Files");
+	if (filecache && head) {
+		fcacheload();
+		if ((fd = mkstemp(fcachetmp)) == -1)
+			err(1, "mkstemp");
+		binit(&wfcache, fd, fcachetmp);
+	}
+	bopen(&ob, "files.html");
+	if (setmtime)
+		ob.mtime = headtime;
+	writeheader(&ob, "Files");
 	if (head)
-		writefiles(fp, head);
-	writefooter(fp);
-	fclose(fp);
-
+		ret = writefiles(&ob, head);
+	writefooter(&ob);
+	bclose(&ob);
+	if (verbose && head)
+		fprintf(stderr, "files: %zu pages written, %zu linked, %zu kept\n",
+		        nfileswritten, nfileslinked, nfileskept);
+
+refs:
 	/* summary page with branches and tags */
-	fp = efopen("refs.html", "w");
-	writeheader(fp, "Refs");
-	writerefs(fp);
-	writefooter(fp);
-	fclose(fp);
+	if (updates & UPDREFS) {
+		bopen(&ob, "refs.html");
+		if (setmtime)
+			ob.mtime = headtime;
+		writeheader(&ob, "Refs");
+		writerefs(&ob);
+		writefooter(&ob);
+		bclose(&ob);
+	}
 
 	/* Atom feed */
-	fp = efopen("atom.xml", "w");
-	writeatom(fp, 1);
-	fclose(fp);
+	if (updates & UPDLOG) {
+		bopen(&ob, "atom.xml");
+		if (setmtime)
+			ob.mtime = headtime;
+		writeatom(&ob, 1);
+		bclose(&ob);
+	}
 
 	/* Atom feed for tags / releases */
-	fp = efopen("tags.xml", "w");
-	writeatom(fp, 0);
-	fclose(fp);
+	if (updates & UPDTAGS) {
+		bopen(&ob, "tags.xml");
+		if (setmtime)
+			ob.mtime = headtime;
+		writeatom(&ob, 0);
+		bclose(&ob);
+	}
+
+	/* the pages are written before the caches refer to them */
+	buringclose();
+
+	/* only the refs were updated: no log, caches or pages to remove */
+	if (!(updates & UPDLOG))
+		goto assets;
+
+	/* the pages of the older commits are not written yet */
+	if ((gc || rewritten) && head && !landing)
+		gcpages(head);
+
+	/* merge new diffstats into the stats store on success */
+	if (statsfile)
+		statswrite();
 
 	/* rename new cache file on success */
 	if (cachefile && head) {
@@ -1757,6 +4020,22 @@ main(int argc, char *argv[])
 			err(1, "chmod: '%s'", cachefile);
 	}
 
+	/* rename new file cache if all files were written */
+	if (filecache && head) {
+		bclose(&wfcache);
+		if (ret == -1) {
+			unlink(fcachetmp);
+		} else {
+			if (rename(fcachetmp, filecache))
+				err(1, "rename: '%s' to '%s'", fcachetmp, filecache);
+			umask((mask = umask(0)));
+			if (chmod(filecache,
+			    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
+				err(1, "chmod: '%s'", filecache);
+		}
+	}
+
+assets:
 	/* copy asset files (style.css, logo.png, favicon.png) to parent directory */
 	{
 		const char *assets[] = {"style.css", "logo.png", "favicon.png"};
@@ -1796,6 +4075,7 @@ main(int argc, char *argv[])
 							}
 						}
 						fclose(dst);
+						manifestfile(AT_FDCWD, dstpath, dstpath, 'A');
 						found = 1;
 					}
 					fclose(src);
@@ -1808,14 +4088,632 @@ main(int argc, char *argv[])
 					fputs("/* stagit default style */\n"
 					      "body { font-family: monospace; }\n", dst);
 					fclose(dst);
+					manifestfile(AT_FDCWD, dstpath, dstpath, 'A');
+				}
+			}
+		}
+	}
+
+	/* the state of this run, the next one starts again */
+	nlogcommits = maxlogcommits;
+	runfree();
+}
+
+/* lock or unlock a byte of the lock file, without waiting -1 if it is
+   locked by another process */
+int
+lockbyte(off_t off, int type, int wait)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+	while (fcntl(lockfd, wait ? F_SETLKW : F_SETLK, &fl) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (!wait && (errno == EACCES || errno == EAGAIN))
+			return -1;
+		err(1, "fcntl: '%s'", LOCKFILE);
+	}
+	return 0;
+}
+
+/* add to the pending updates and return them, with take they are cleared */
+int
+pendingupdates(int add, int take)
+{
+	unsigned char c = 0;
+
+	lockbyte(1, F_WRLCK, 1);
+	if (pread(lockfd, &c, 1, 2) == -1)
+		err(1, "read: '%s'", LOCKFILE);
+	c |= add;
+	if (pwrite(lockfd, take ? "" : (char *)&c, 1, 2) != 1)
+		err(1, "write: '%s'", LOCKFILE);
+	lockbyte(1, F_UNLCK, 1);
+
+	return c;
+}
+
+/* -n without the log cache, on a first run or after it was removed: the
+   landing pages with the newest commits are written first, then the pages
+   of the older commits in chunks. Returns 0 if new updates stopped the
+   backfill, they run first and it goes on after them: the pages written so
+   far are kept. */
+int
+writepriority(void)
+{
+	git_object *obj = NULL;
+	git_oid head, next;
+	const char *cf = cachefile;
+	long long lp = logpagesize;
+	int more, r = rewritten;
+
+	/* log.html has the newest rows, without the cache */
+	cachefile = NULL;
+	logpagesize = 0;
+	nlogcommits = prioritycommits;
+	landing = 1;
+	writerepo();
+	landing = 0;
+
+	nlogcommits = 0;
+	more = 0;
+	if (!git_revparse_single(&obj, repo, "HEAD")) {
+		head = *git_object_id(obj);
+		if (useuring)
+			buringopen();
+		if (statsfile)
+			statsload();
+		do {
+			more = backfill(&head, &next, more);
+			if (statsfile)
+				statsflush();
+		} while (more && !pendingupdates(0, 0));
+		buringclose();
+		runfree();
+	}
+	git_object_free(obj);
+
+	cachefile = cf;
+	logpagesize = lp;
+	nlogcommits = -1;
+	rewritten = r;
+	if (more) {
+		pendingupdates(UPDLOG | (r ? UPDREWRITE : 0), 0);
+		return 0;
+	}
+	return 1;
+}
+
+/* write the pages unless another run has the output directory: then it
+   writes the pages of these updates after its own, so concurrent runs cost
+   at most two runs */
+void
+lockedrun(void)
+{
+	int fd, u, opened = 0;
+
+	if (lockfd == -1 &&
+	    (lockfd = open(LOCKFILE, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) == -1)
+		err(1, "open: '%s'", LOCKFILE);
+	pendingupdates(updates | (rewritten ? UPDREWRITE : 0), 0);
+	for (;;) {
+		if (lockbyte(0, F_WRLCK, 0) == -1) {
+			if (verbose)
+				fprintf(stderr, "%s: locked, the pages are written "
+				        "by the other run\n", LOCKFILE);
+			break;
+		}
+		/* the manifest has the files of all the runs */
+		if (manifest && !opened) {
+			if ((fd = open(manifest, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+				err(1, "open: '%s'", manifest);
+			binit(&wmanifest, fd, manifest);
+			bpublished = manifestadd;
+			opened = 1;
+		}
+		while ((u = pendingupdates(0, 1))) {
+			updates = u & (UPDLOG | UPDREFS | UPDTAGS);
+			rewritten = (u & UPDREWRITE) != 0;
+			if (prioritycommits && (updates & UPDLOG) &&
+			    access(cachefile, F_OK) == -1 && !writepriority())
+				continue;
+			writerepo();
+		}
+		lockbyte(0, F_UNLCK, 1);
+		/* updates added after the last check */
+		if (!pendingupdates(0, 0))
+			break;
+	}
+	if (opened)
+		bclose(&wmanifest);
+	updates = rewritten = 0;
+}
+
+int
+refstate_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct refstate *)a)->name,
+	              ((const struct refstate *)b)->name);
+}
+
+void
+refsadd(struct refstate **rs, size_t *nrs, size_t *cap, const char *refname)
+{
+	git_oid id;
+
+	if (git_reference_name_to_id(&id, repo, refname))
+		return;
+	if (*nrs == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		if (!(*rs = reallocarray(*rs, *cap, sizeof(**rs))))
+			err(1, "realloc");
+	}
+	if (!((*rs)[*nrs].name = strdup(refname)))
+		err(1, "strdup");
+	(*rs)[(*nrs)++].id = id;
+}
+
+/* the refs and HEAD of the repository, sorted by name */
+struct refstate *
+refsnapshot(size_t *nrs)
+{
+	git_reference_iterator *it;
+	git_reference *ref;
+	struct refstate *rs = NULL;
+	size_t cap = 0;
+
+	*nrs = 0;
+	if (git_reference_iterator_new(&it, repo))
+		errx(1, "%s: cannot read the refs", repodir);
+	refsadd(&rs, nrs, &cap, "HEAD");
+	while (!git_reference_next(&ref, it)) {
+		refsadd(&rs, nrs, &cap, git_reference_name(ref));
+		git_reference_free(ref);
+	}
+	git_reference_iterator_free(it);
+	qsort(rs, *nrs, sizeof(*rs), refstate_cmp);
+
+	return rs;
+}
+
+void
+refsfree(struct refstate *rs, size_t nrs)
+{
+	size_t i;
+
+	for (i = 0; i < nrs; i++)
+		free(rs[i].name);
+	free(rs);
+}
+
+/* set the pages to write for the refs which changed between two snapshots */
+void
+refsdiff(struct refstate *old, size_t nold, struct refstate *new, size_t nnew)
+{
+	git_oid zero;
+	size_t i = 0, j = 0;
+	int c;
+
+	memset(&zero, 0, sizeof(zero));
+	while (i < nold || j < nnew) {
+		if (i >= nold)
+			c = 1;
+		else if (j >= nnew)
+			c = -1;
+		else
+			c = strcmp(old[i].name, new[j].name);
+
+		if (c < 0) {
+			refupdate(&(old[i].id), &zero, old[i].name, "HEAD");
+			i++;
+		} else if (c > 0) {
+			refupdate(&zero, &(new[j].id), new[j].name, "HEAD");
+			j++;
+		} else {
+			if (git_oid_cmp(&(old[i].id), &(new[j].id)))
+				refupdate(&(old[i].id), &(new[j].id), new[j].name, "HEAD");
+			i++;
+			j++;
+		}
+	}
+}
+
+#ifdef __linux__
+/* watch a directory of refs and its subdirectories */
+void
+watchrefs(int ifd, const char *path)
+{
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+	char sub[PATH_MAX];
+	int wd;
+
+	if ((wd = inotify_add_watch(ifd, path, IN_CREATE | IN_CLOSE_WRITE |
+	    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_ONLYDIR)) == -1)
+		err(1, "inotify_add_watch: '%s'", path);
+	if ((size_t)wd >= nwatchdirs) {
+		if (!(watchdirs = reallocarray(watchdirs, wd + 1, sizeof(*watchdirs))))
+			err(1, "realloc");
+		memset(watchdirs + nwatchdirs, 0, (wd + 1 - nwatchdirs) * sizeof(*watchdirs));
+		nwatchdirs = wd + 1;
+	}
+	free(watchdirs[wd]);
+	if (!(watchdirs[wd] = strdup(path)))
+		err(1, "strdup");
+
+	if (!(dp = opendir(path)))
+		err(1, "opendir: '%s'", path);
+	while ((d = readdir(dp))) {
+		/* also "." and "..", a ref name does not start with a dot */
+		if (d->d_name[0] == '.')
+			continue;
+		joinpath(sub, sizeof(sub), path, d->d_name);
+		if (d->d_type == DT_DIR ||
+		    (d->d_type == DT_UNKNOWN && !stat(sub, &st) && S_ISDIR(st.st_mode)))
+			watchrefs(ifd, sub);
+	}
+	closedir(dp);
+}
+
+/* write the pages, then again for each change of the refs: HEAD,
+   packed-refs, refs/ or the description and url in the git directory */
+void
+watchrepo(void)
+{
+	struct inotify_event *ev;
+	struct refstate *old, *new;
+	struct pollfd pfd;
+	char evbuf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX], *p;
+	const char *gitdir;
+	size_t nold, nnew, len;
+	ssize_t n;
+	int ifd, gitwd, timeout, changed, all, r;
+
+	gitdir = git_repository_path(repo);
+	if ((ifd = inotify_init1(IN_CLOEXEC)) == -1)
+		err(1, "inotify_init1");
+	if ((gitwd = inotify_add_watch(ifd, gitdir, IN_CLOSE_WRITE |
+	    IN_MOVED_TO | IN_DELETE | IN_ONLYDIR)) == -1)
+		err(1, "inotify_add_watch: '%s'", gitdir);
+	joinpath(path, sizeof(path), gitdir, "refs");
+	watchrefs(ifd, path);
+
+	old = refsnapshot(&nold);
+	lockedrun();
+	for (;;) {
+		/* wait for a change, then until there is none for WATCHDELAY ms */
+		changed = all = 0;
+		for (timeout = -1; ; timeout = changed ? WATCHDELAY : -1) {
+			pfd.fd = ifd;
+			pfd.events = POLLIN;
+			if ((r = poll(&pfd, 1, timeout)) == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "poll");
+			}
+			if (!r)
+				break;
+			if ((n = read(ifd, evbuf, sizeof(evbuf))) == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "read: inotify");
+			}
+			for (p = evbuf; p < evbuf + n; p += sizeof(*ev) + ev->len) {
+				ev = (struct inotify_event *)p;
+				if (ev->mask & IN_Q_OVERFLOW) {
+					changed = all = 1;
+					continue;
+				}
+				if (!ev->len)
+					continue;
+				if (ev->wd == gitwd) {
+					if (!strcmp(ev->name, "HEAD") ||
+					    !strcmp(ev->name, "packed-refs")) {
+						changed = 1;
+					} else if (!strcmp(ev->name, "description") ||
+					           !strcmp(ev->name, "url")) {
+						changed = all = 1;
+					}
+					continue;
+				}
+				if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+				    ev->wd >= 0 && (size_t)ev->wd < nwatchdirs && watchdirs[ev->wd]) {
+					joinpath(path, sizeof(path), watchdirs[ev->wd], ev->name);
+					watchrefs(ifd, path);
 				}
+				/* a ref is written to its lock file, then renamed */
+				len = strlen(ev->name);
+				if (len < 5 || strcmp(ev->name + len - 5, ".lock"))
+					changed = 1;
 			}
 		}
+
+		new = refsnapshot(&nnew);
+		updates = all ? UPDLOG | UPDREFS | UPDTAGS : 0;
+		refsdiff(old, nold, new, nnew);
+		refsfree(old, nold);
+		old = new;
+		nold = nnew;
+		if (updates)
+			lockedrun();
+	}
+}
+#else
+void
+watchrepo(void)
+{
+	errx(1, "-w: inotify is not supported on this system");
+}
+#endif
+
+/* write the pages of repodir to the current directory */
+int
+runrepo(const char *argv0)
+{
+	char repodirabs[PATH_MAX + 1], *p;
+
+	if (!realpath(repodir, repodirabs))
+		err(1, "realpath");
+
+	git_libgit2_init();
+
+#ifdef __OpenBSD__
+	if (unveil(repodir, "r") == -1)
+		err(1, "unveil: %s", repodir);
+	if (unveil(".", "rwc") == -1)
+		err(1, "unveil: .");
+	if (cachefile && unveil(cachefile, "rwc") == -1)
+		err(1, "unveil: %s", cachefile);
+	if (statsfile && unveil(statsfile, "rwc") == -1)
+		err(1, "unveil: %s", statsfile);
+	if (filecache && unveil(filecache, "rwc") == -1)
+		err(1, "unveil: %s", filecache);
+	if (manifest && unveil(manifest, "wc") == -1)
+		err(1, "unveil: %s", manifest);
+
+	if (cachefile || statsfile || filecache || setmtime) {
+		if (pledge("stdio rpath wpath cpath fattr flock", NULL) == -1)
+			err(1, "pledge");
+	} else {
+		if (pledge("stdio rpath wpath cpath flock", NULL) == -1)
+			err(1, "pledge");
+	}
+#endif
+
+	if (git_repository_open_ext(&repo, repodir,
+		GIT_REPOSITORY_OPEN_NO_SEARCH, NULL) < 0) {
+		fprintf(stderr, "%s: cannot open repository\n", argv0);
+		return 1;
 	}
 
+	/* use directory name as name */
+	if ((name = strrchr(repodirabs, '/')))
+		name++;
+	else
+		name = "";
+
+	/* strip .git suffix */
+	if (!(strippedname = strdup(name)))
+		err(1, "strdup");
+	if ((p = strrchr(strippedname, '.')))
+		if (!strcmp(p, ".git"))
+			*p = '\0';
+
+	if (hook)
+		readupdates();
+	if (watch)
+		watchrepo();
+	else
+		lockedrun();
+
 	/* cleanup */
 	git_repository_free(repo);
 	git_libgit2_shutdown();
 
 	return 0;
 }
+
+/* -b: write the pages of the repositories of the lines "repodir outdir" of
+   batchfile, each in a process of its own in outdir. With the job server
+   at most jobs processes and workers run at a time: the workers of the
+   last repositories take the jobs the others leave. */
+int
+runbatch(void)
+{
+	struct batchrepo {
+		char *dir, *out;
+		pid_t pid;
+	} *brs = NULL;
+	FILE *fp;
+	char line[2 * PATH_MAX + 2], abs[PATH_MAX + 1], *dir, *out;
+	size_t nbrs = 0, capbrs = 0, i, j;
+	long long running = 0;
+	pid_t pid;
+	int status, ret = 0;
+
+	/* read all the lines first: the processes share the file offset */
+	if (!strcmp(batchfile, "-"))
+		fp = stdin;
+	else if (!(fp = fopen(batchfile, "r")))
+		err(1, "fopen: '%s'", batchfile);
+	while (fgets(line, sizeof(line), fp)) {
+		if (!(dir = strtok(line, " \t\n")))
+			continue;
+		if (!(out = strtok(NULL, " \t\n")))
+			errx(1, "%s: no output directory for '%s'", batchfile, dir);
+		if (nbrs == capbrs) {
+			capbrs = capbrs ? capbrs * 2 : 64;
+			if (!(brs = reallocarray(brs, capbrs, sizeof(*brs))))
+				err(1, "realloc");
+		}
+		if (!(brs[nbrs].dir = strdup(dir)) || !(brs[nbrs].out = strdup(out)))
+			err(1, "strdup");
+		brs[nbrs++].pid = -1;
+	}
+	if (ferror(fp))
+		err(1, "fgets: '%s'", batchfile);
+	if (fp != stdin)
+		fclose(fp);
+
+	/* a waiting worker polls, to see if its run is done meanwhile */
+	if (pipe(jobpipe) == -1)
+		err(1, "pipe");
+	if (fcntl(jobpipe[0], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	for (i = 0; i < (size_t)nthreads; i++)
+		jobgive();
+
+	for (i = 0; i <= nbrs; i++) {
+		/* a process returns its token when it is done */
+		while (running && (running == nthreads || i == nbrs)) {
+			if ((pid = wait(&status)) == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "wait");
+			}
+			for (j = 0; j < nbrs && brs[j].pid != pid; j++)
+				;
+			if (j == nbrs)
+				continue;
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+				fprintf(stderr, "%s: failed\n", brs[j].dir);
+				ret = 1;
+			}
+			running--;
+			jobgive();
+		}
+		if (i == nbrs)
+			break;
+
+		jobtake(NULL);
+		fflush(stdout);
+		fflush(stderr);
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (!pid) {
+			if (!realpath(brs[i].dir, abs))
+				err(1, "realpath: '%s'", brs[i].dir);
+			if (mkdir(brs[i].out, S_IRWXU | S_IRWXG | S_IRWXO) == -1 &&
+			    errno != EEXIST)
+				err(1, "mkdir: '%s'", brs[i].out);
+			if (chdir(brs[i].out) == -1)
+				err(1, "chdir: '%s'", brs[i].out);
+			repodir = abs;
+			exit(runrepo(brs[i].dir));
+		}
+		brs[i].pid = pid;
+		running++;
+	}
+
+	for (i = 0; i < nbrs; i++) {
+		free(brs[i].dir);
+		free(brs[i].out);
+	}
+	free(brs);
+
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *p;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-') {
+			if (repodir)
+				usage(argv[0]);
+			repodir = argv[i];
+		} else if (argv[i][1] == 'c') {
+			if (nlogcommits > 0 || i + 1 >= argc)
+				usage(argv[0]);
+			cachefile = argv[++i];
+		} else if (argv[i][1] == 'l') {
+			if (cachefile || logpagesize || i + 1 >= argc)
+				usage(argv[0]);
+			errno = 0;
+			nlogcommits = strtoll(argv[++i], &p, 10);
+			if (argv[i][0] == '\0' || *p != '\0' ||
+			    nlogcommits <= 0 || errno)
+				usage(argv[0]);
+		} else if (argv[i][1] == 'v') {
+			verbose = 1;
+		} else if (argv[i][1] == 'd') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			errno = 0;
+			maxdiff = strtoll(argv[++i], &p, 10);
+			if (argv[i][0] == '\0' || *p != '\0' ||
+			    maxdiff < 0 || errno)
+				usage(argv[0]);
+		} else if (argv[i][1] == 'f') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			filecache = argv[++i];
+		} else if (argv[i][1] == 'm') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			manifest = argv[++i];
+		} else if (argv[i][1] == 'n') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			errno = 0;
+			prioritycommits = strtoll(argv[++i], &p, 10);
+			if (argv[i][0] == '\0' || *p != '\0' ||
+			    prioritycommits <= 0 || errno)
+				usage(argv[0]);
+		} else if (argv[i][1] == 'p') {
+			if (nlogcommits > 0 || i + 1 >= argc)
+				usage(argv[0]);
+			errno = 0;
+			logpagesize = strtoll(argv[++i], &p, 10);
+			if (argv[i][0] == '\0' || *p != '\0' ||
+			    logpagesize <= 0 || errno)
+				usage(argv[0]);
+		} else if (argv[i][1] == 's') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			statsfile = argv[++i];
+		} else if (argv[i][1] == 'j') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			errno = 0;
+			nthreads = strtoll(argv[++i], &p, 10);
+			if (argv[i][0] == '\0' || *p != '\0' ||
+			    nthreads <= 0 || errno)
+				usage(argv[0]);
+		} else if (argv[i][1] == 'g') {
+			gc = 1;
+		} else if (argv[i][1] == 'r') {
+			if (watch || batchfile)
+				usage(argv[0]);
+			hook = 1;
+		} else if (argv[i][1] == 't') {
+			setmtime = 1;
+		} else if (argv[i][1] == 'u') {
+			useuring = 1;
+		} else if (argv[i][1] == 'w') {
+			if (hook || batchfile)
+				usage(argv[0]);
+			watch = 1;
+		} else if (argv[i][1] == 'b') {
+			if (hook || watch || i + 1 >= argc)
+				usage(argv[0]);
+			batchfile = argv[++i];
+		}
+	}
+	if (!repodir == !batchfile || (prioritycommits && !cachefile))
+		usage(argv[0]);
+
+	if (batchfile)
+		return runbatch();
+	return runrepo(argv[0]);
+}
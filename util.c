@@ -0,0 +1,717 @@
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XMLSCAN_X86
+#include <immintrin.h>
+#endif
+
+#include "util.h"
+
+#ifdef WITH_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+/* write-behind of the pages with io_uring: a changed page of bopen() is
+   kept in memory and its write, close and rename are queued on bclose() */
+#define URINGENTRIES 96               /* three entries per page */
+#define URINGBATCH   8                /* pages queued per submission */
+#define URINGMEM     (8 * 1024 * 1024) /* bytes of the pages in flight */
+
+enum { URINGWRITE, URINGCLOSE, URINGRENAME };
+
+struct uringpage {
+	char *buf;
+	size_t len;
+	int fd;
+	int pending; /* completions to wait for, 0 is a free slot */
+	char *name;
+	char *tmp;
+	long long mtime;
+};
+
+struct uring {
+	int fd;
+	void *sqmap, *cqmap;
+	size_t sqmaplen, cqmaplen, sqeslen;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued;  /* entries not submitted yet */
+	size_t inflight;  /* bytes of the pages in flight */
+	struct uringpage pages[URINGENTRIES / 3];
+};
+
+static _Thread_local struct uring *uring;
+#endif
+
+/* buffers kept in memory start small, they are mostly log rows */
+#define OBUFMEMSIZ 1024
+
+/* characters xmlencode() stops at: escaped ones and the NUL byte */
+static const unsigned char xmlspecial[256] = {
+	['\0'] = 1, ['<'] = 1, ['>'] = 1, ['\''] = 1, ['&'] = 1, ['"'] = 1
+};
+
+static size_t xmlscan_scalar(const char *, size_t);
+
+/* chosen once by the CPU features, see xmlscan_init() */
+static size_t (*xmlscan)(const char *, size_t) = xmlscan_scalar;
+static pthread_once_t xmlscan_once = PTHREAD_ONCE_INIT;
+
+/* length of the run of characters that can be written as-is */
+static size_t
+xmlscan_scalar(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (xmlspecial[(unsigned char)s[i]])
+			break;
+	return i;
+}
+
+#ifdef XMLSCAN_X86
+__attribute__((target("sse2")))
+static size_t
+xmlscan_sse2(const char *s, size_t len)
+{
+	const __m128i nul = _mm_setzero_si128(), lt = _mm_set1_epi8('<'),
+		gt = _mm_set1_epi8('>'), apos = _mm_set1_epi8('\''),
+		amp = _mm_set1_epi8('&'), quot = _mm_set1_epi8('"');
+	__m128i v, m;
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_cmpeq_epi8(v, lt)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, apos)));
+		m = _mm_or_si128(m,
+			_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)));
+		if ((mask = _mm_movemask_epi8(m)))
+			return i + __builtin_ctz(mask);
+	}
+	return i + xmlscan_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+xmlscan_avx2(const char *s, size_t len)
+{
+	const __m256i nul = _mm256_setzero_si256(), lt = _mm256_set1_epi8('<'),
+		gt = _mm256_set1_epi8('>'), apos = _mm256_set1_epi8('\''),
+		amp = _mm256_set1_epi8('&'), quot = _mm256_set1_epi8('"');
+	__m256i v, m;
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, nul), _mm256_cmpeq_epi8(v, lt)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_cmpeq_epi8(v, apos)));
+		m = _mm256_or_si256(m,
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, quot)));
+		if ((mask = (unsigned int)_mm256_movemask_epi8(m)))
+			return i + __builtin_ctz(mask);
+	}
+	return i + xmlscan_sse2(s + i, len - i);
+}
+#endif
+
+static void
+xmlscan_init(void)
+{
+#ifdef XMLSCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		xmlscan = xmlscan_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		xmlscan = xmlscan_sse2;
+#endif
+}
+
+void
+binit(struct obuf *ob, int fd, const char *name)
+{
+	memset(ob, 0, sizeof(*ob));
+	ob->cap = fd == -1 ? OBUFMEMSIZ : OBUFSIZ;
+	if (!(ob->buf = malloc(ob->cap)))
+		err(1, "malloc");
+	ob->fd = fd;
+	ob->name = name;
+}
+
+/* name is kept for error messages */
+void
+bopen(struct obuf *ob, const char *name)
+{
+	bopenat(ob, AT_FDCWD, name, name);
+}
+
+/* write the file name in the directory dirfd, name is the last component of
+   path which is relative to the current directory. The file is replaced on
+   bclose() if it changed, dirfd is used until then. */
+void
+bopenat(struct obuf *ob, int dirfd, const char *name, const char *path)
+{
+	binit(ob, -1, path);
+	ob->cap = OBUFSIZ;
+	if (!(ob->buf = realloc(ob->buf, ob->cap)))
+		err(1, "realloc");
+	ob->dirfd = dirfd;
+	ob->base = name;
+}
+
+void (*bpublished)(const char *, int, unsigned long long, unsigned long long);
+
+unsigned long long
+fnv1a(unsigned long long h, const void *p, size_t n)
+{
+	const unsigned char *s = p;
+
+	while (n--)
+		h = (h ^ *s++) * 0x100000001b3ULL;
+	return h;
+}
+
+/* size and FNV-1a hash of the file name in dirfd, returns -1 on error */
+int
+hashfile(int dirfd, const char *name, unsigned long long *size,
+	unsigned long long *hash)
+{
+	char buf[OBUFSIZ];
+	ssize_t r;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY)) == -1)
+		return -1;
+	*size = 0;
+	*hash = FNV1AINIT;
+	while ((r = read(fd, buf, sizeof(buf))) > 0) {
+		*hash = fnv1a(*hash, buf, r);
+		*size += r;
+	}
+	close(fd);
+
+	return r == 0 ? 0 : -1;
+}
+
+/* create the temporary file in the directory of the file */
+static void
+bopentmp(struct obuf *ob)
+{
+	static unsigned long long ntmp;
+	char tmp[PATH_MAX];
+	size_t dirlen;
+	int r;
+
+	dirlen = strlen(ob->name) - strlen(ob->base);
+	for (;;) {
+		r = snprintf(tmp, sizeof(tmp), "%.*s.stagit.%ld.%llu", (int)dirlen,
+		             ob->name, (long)getpid(),
+		             __atomic_fetch_add(&ntmp, 1, __ATOMIC_RELAXED));
+		if (r < 0 || (size_t)r >= sizeof(tmp))
+			errx(1, "path truncated: '%s'", ob->name);
+		if ((ob->fd = openat(ob->dirfd, tmp + dirlen,
+		                     O_WRONLY | O_CREAT | O_EXCL, 0666)) != -1)
+			break;
+		if (errno != EEXIST)
+			err(1, "open: '%s'", tmp);
+	}
+	if (!(ob->tmp = strdup(tmp)))
+		err(1, "strdup");
+	ob->total = 0;
+	ob->hash = FNV1AINIT;
+}
+
+/* compare the file with the page, in memory or by the hash of tmp */
+static int
+bsame(struct obuf *ob, int *exists)
+{
+	struct stat st;
+	unsigned long long size, h = FNV1AINIT;
+	char buf[OBUFSIZ];
+	size_t off = 0;
+	ssize_t r;
+	int fd, same = 0;
+
+	size = ob->tmp ? ob->total : ob->len;
+	if ((fd = openat(ob->dirfd, ob->base, O_RDONLY)) == -1) {
+		*exists = errno != ENOENT;
+		return 0;
+	}
+	*exists = 1;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (unsigned long long)st.st_size != size)
+		goto end;
+	while ((r = read(fd, buf, sizeof(buf))) > 0) {
+		if (off + r > size)
+			goto end;
+		if (ob->tmp)
+			h = fnv1a(h, buf, r);
+		else if (memcmp(ob->buf + off, buf, r))
+			goto end;
+		off += r;
+	}
+	same = r == 0 && off == size && (!ob->tmp || h == ob->hash);
+end:
+	close(fd);
+	return same;
+}
+
+static void
+bwriteall(struct obuf *ob, const char *p, size_t n)
+{
+	ssize_t r;
+
+	if (ob->tmp) {
+		ob->hash = fnv1a(ob->hash, p, n);
+		ob->total += n;
+	}
+	while (n) {
+		if ((r = write(ob->fd, p, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "write: '%s'", ob->name);
+		}
+		p += r;
+		n -= r;
+	}
+}
+
+void
+bflush(struct obuf *ob)
+{
+	if (ob->fd != -1 && ob->len) {
+		bwriteall(ob, ob->buf, ob->len);
+		ob->len = 0;
+	}
+}
+
+#ifdef WITH_URING
+static void
+uringsubmit(unsigned wait)
+{
+	int r;
+
+	while ((r = syscall(__NR_io_uring_enter, uring->fd, uring->queued, wait,
+	                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) == -1) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			err(1, "io_uring_enter");
+		wait = 1; /* wait for completions to make room */
+	}
+	uring->queued -= r;
+}
+
+/* free the pages of the completed entries */
+static void
+uringreap(void)
+{
+	struct io_uring_cqe *cqe;
+	struct uringpage *pg;
+	struct timespec ts[2];
+	unsigned head;
+
+	head = *uring->cqhead;
+	for (; head != __atomic_load_n(uring->cqtail, __ATOMIC_ACQUIRE); head++) {
+		cqe = &uring->cqes[head & *uring->cqmask];
+		pg = &uring->pages[cqe->user_data >> 2];
+		if (cqe->res < 0)
+			errno = -cqe->res;
+		switch (cqe->user_data & 3) {
+		case URINGWRITE:
+			if (cqe->res < 0)
+				err(1, "write: '%s'", pg->tmp);
+			if ((size_t)cqe->res != pg->len)
+				errx(1, "write: '%s': short write", pg->tmp);
+			uring->inflight -= pg->len;
+			free(pg->buf);
+			pg->buf = NULL;
+			break;
+		case URINGCLOSE:
+			if (cqe->res < 0)
+				err(1, "close: '%s'", pg->tmp);
+			break;
+		case URINGRENAME:
+			if (cqe->res < 0)
+				err(1, "rename: '%s' to '%s'", pg->tmp, pg->name);
+			if (pg->mtime) {
+				ts[0].tv_sec = ts[1].tv_sec = pg->mtime;
+				ts[0].tv_nsec = ts[1].tv_nsec = 0;
+				if (utimensat(AT_FDCWD, pg->name, ts, 0) == -1)
+					err(1, "utimensat: '%s'", pg->name);
+			}
+			break;
+		}
+		if (!--pg->pending) {
+			free(pg->name);
+			free(pg->tmp);
+			pg->name = pg->tmp = NULL;
+		}
+	}
+	__atomic_store_n(uring->cqhead, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *
+uringsqe(void)
+{
+	unsigned tail;
+	struct io_uring_sqe *sqe;
+
+	tail = *uring->sqtail;
+	sqe = &uring->sqes[tail & *uring->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sqarray[tail & *uring->sqmask] = tail & *uring->sqmask;
+	__atomic_store_n(uring->sqtail, tail + 1, __ATOMIC_RELEASE);
+	uring->queued++;
+
+	return sqe;
+}
+
+/* queue the write, close and rename of the page in tmp, returns -1 if it is
+   written now */
+static int
+uringqueue(struct obuf *ob)
+{
+	struct io_uring_sqe *sqe;
+	struct uringpage *pg = NULL;
+	size_t i;
+
+	if (ob->len > URINGMEM || ob->len > UINT_MAX)
+		return -1;
+	for (;;) {
+		uringreap();
+		for (i = 0; i < URINGENTRIES / 3; i++)
+			if (!uring->pages[i].pending)
+				break;
+		if (i < URINGENTRIES / 3 && uring->inflight + ob->len <= URINGMEM)
+			break;
+		uringsubmit(1);
+	}
+	pg = &uring->pages[i];
+	if (!(pg->name = strdup(ob->name)))
+		err(1, "strdup");
+	pg->tmp = ob->tmp;
+	pg->buf = ob->buf;
+	pg->len = ob->len;
+	pg->fd = ob->fd;
+	pg->mtime = ob->mtime;
+	pg->pending = 3;
+	uring->inflight += ob->len;
+
+	sqe = uringsqe();
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = pg->fd;
+	sqe->addr = (uintptr_t)pg->buf;
+	sqe->len = pg->len;
+	sqe->off = 0;
+	sqe->user_data = i << 2 | URINGWRITE;
+
+	sqe = uringsqe();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = pg->fd;
+	sqe->user_data = i << 2 | URINGCLOSE;
+
+	/* the paths are relative to the current directory: the directory of
+	   the page can be closed before the rename is done */
+	sqe = uringsqe();
+	sqe->opcode = IORING_OP_RENAMEAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)pg->tmp;
+	sqe->len = AT_FDCWD;
+	sqe->addr2 = (uintptr_t)pg->name;
+	sqe->user_data = i << 2 | URINGRENAME;
+
+	if (uring->queued >= URINGBATCH * 3)
+		uringsubmit(0);
+
+	return 0;
+}
+
+/* set up the ring of this thread, returns -1 if io_uring is not available */
+int
+buringopen(void)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	int fd;
+
+	if (uring)
+		return 0;
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, URINGENTRIES, &p)) == -1)
+		return -1;
+	if (!(u = calloc(1, sizeof(*u))))
+		err(1, "calloc");
+	u->fd = fd;
+	u->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((u->sqmap = mmap(NULL, u->sqmaplen, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING)) == MAP_FAILED ||
+	    (u->cqmap = mmap(NULL, u->cqmaplen, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED ||
+	    (u->sqes = mmap(NULL, u->sqeslen, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED)
+		err(1, "mmap: io_uring");
+	u->sqhead = (unsigned *)((char *)u->sqmap + p.sq_off.head);
+	u->sqtail = (unsigned *)((char *)u->sqmap + p.sq_off.tail);
+	u->sqmask = (unsigned *)((char *)u->sqmap + p.sq_off.ring_mask);
+	u->sqarray = (unsigned *)((char *)u->sqmap + p.sq_off.array);
+	u->cqhead = (unsigned *)((char *)u->cqmap + p.cq_off.head);
+	u->cqtail = (unsigned *)((char *)u->cqmap + p.cq_off.tail);
+	u->cqmask = (unsigned *)((char *)u->cqmap + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cqmap + p.cq_off.cqes);
+	uring = u;
+
+	return 0;
+}
+
+/* wait for the pages in flight of this thread */
+void
+buringsync(void)
+{
+	size_t i;
+
+	if (!uring)
+		return;
+	for (;;) {
+		uringreap();
+		for (i = 0; i < URINGENTRIES / 3; i++)
+			if (uring->pages[i].pending)
+				break;
+		if (i == URINGENTRIES / 3)
+			break;
+		uringsubmit(1);
+	}
+}
+
+/* wait for the pages in flight and tear down the ring of this thread */
+void
+buringclose(void)
+{
+	if (!uring)
+		return;
+	buringsync();
+	munmap(uring->sqes, uring->sqeslen);
+	munmap(uring->cqmap, uring->cqmaplen);
+	munmap(uring->sqmap, uring->sqmaplen);
+	close(uring->fd);
+	free(uring);
+	uring = NULL;
+}
+#else
+int
+buringopen(void)
+{
+	return -1;
+}
+
+void
+buringsync(void)
+{
+}
+
+void
+buringclose(void)
+{
+}
+#endif
+
+/* replace the file of bopen() if it changed */
+static void
+bpublish(struct obuf *ob)
+{
+	struct timespec ts[2];
+	const char *tmpbase;
+	int exists, streamed;
+
+	/* a page too large for memory is in tmp already */
+	if (!(streamed = ob->tmp != NULL)) {
+		if (bsame(ob, &exists))
+			return;
+		if (bpublished)
+			bpublished(ob->name, exists ? 'M' : 'A', ob->len,
+			           fnv1a(FNV1AINIT, ob->buf, ob->len));
+		bopentmp(ob);
+#ifdef WITH_URING
+		if (uring && !uringqueue(ob)) {
+			ob->buf = ob->tmp = NULL;
+			ob->fd = -1;
+			return;
+		}
+#endif
+	}
+	bflush(ob);
+	tmpbase = ob->tmp + strlen(ob->name) - strlen(ob->base);
+	if (streamed) {
+		if (bsame(ob, &exists)) {
+			close(ob->fd);
+			unlinkat(ob->dirfd, tmpbase, 0);
+			return;
+		}
+		if (bpublished)
+			bpublished(ob->name, exists ? 'M' : 'A', ob->total, ob->hash);
+	}
+	if (ob->mtime) {
+		ts[0].tv_sec = ts[1].tv_sec = ob->mtime;
+		ts[0].tv_nsec = ts[1].tv_nsec = 0;
+		if (futimens(ob->fd, ts) == -1)
+			err(1, "futimens: '%s'", ob->tmp);
+	}
+	if (close(ob->fd) == -1)
+		err(1, "close: '%s'", ob->tmp);
+	if (renameat(ob->dirfd, tmpbase, ob->dirfd, ob->base) == -1)
+		err(1, "rename: '%s' to '%s'", ob->tmp, ob->name);
+}
+
+void
+bclose(struct obuf *ob)
+{
+	if (ob->base) {
+		bpublish(ob);
+	} else {
+		bflush(ob);
+		if (ob->fd != -1 && close(ob->fd) == -1)
+			err(1, "close: '%s'", ob->name);
+	}
+	free(ob->buf);
+	free(ob->tmp);
+	ob->buf = ob->tmp = NULL;
+	ob->len = ob->cap = 0;
+	ob->fd = -1;
+	ob->base = NULL;
+}
+
+/* make room for n more bytes */
+static void
+breserve(struct obuf *ob, size_t n)
+{
+	size_t cap;
+
+	if (ob->cap - ob->len >= n)
+		return;
+	/* a page too large to keep in memory is written as it is made */
+	if (ob->base && ob->fd == -1 && ob->len + n > OBUFKEEP)
+		bopentmp(ob);
+	bflush(ob);
+	if (ob->cap - ob->len >= n)
+		return;
+	for (cap = ob->cap; cap - ob->len < n; cap *= 2)
+		;
+	if (!(ob->buf = realloc(ob->buf, cap)))
+		err(1, "realloc");
+	ob->cap = cap;
+}
+
+void
+bwrite(struct obuf *ob, const void *p, size_t n)
+{
+	if (ob->cap - ob->len < n) {
+		bflush(ob);
+		/* too large to buffer: write it at once */
+		if (ob->fd != -1 && n >= ob->cap) {
+			bwriteall(ob, p, n);
+			return;
+		}
+		breserve(ob, n);
+	}
+	if (n)
+		memcpy(ob->buf + ob->len, p, n);
+	ob->len += n;
+}
+
+void
+bputs(struct obuf *ob, const char *s)
+{
+	bwrite(ob, s, strlen(s));
+}
+
+void
+bputc(struct obuf *ob, int c)
+{
+	if (ob->len == ob->cap)
+		breserve(ob, 1);
+	ob->buf[ob->len++] = c;
+}
+
+/* decimal number, right-aligned with spaces to at least width */
+void
+bputnum(struct obuf *ob, unsigned long long n, int width)
+{
+	char tmp[32], *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (p > tmp && tmp + sizeof(tmp) - p < width)
+		*--p = ' ';
+	bwrite(ob, p, tmp + sizeof(tmp) - p);
+}
+
+void
+bprintf(struct obuf *ob, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(ob->buf + ob->len, ob->cap - ob->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		err(1, "vsnprintf");
+	if ((size_t)n >= ob->cap - ob->len) {
+		breserve(ob, (size_t)n + 1);
+		va_start(ap, fmt);
+		vsnprintf(ob->buf + ob->len, ob->cap - ob->len, fmt, ap);
+		va_end(ap);
+	}
+	ob->len += n;
+}
+
+/* Escape characters below as HTML 2.0 / XML 1.0.
+   Runs without such characters are written at once. */
+void
+xmlencode(struct obuf *ob, const char *s, size_t len)
+{
+	size_t n;
+
+	pthread_once(&xmlscan_once, xmlscan_init);
+
+	while (len) {
+		if ((n = xmlscan(s, len)))
+			bwrite(ob, s, n);
+		if (n == len)
+			break;
+		switch (s[n]) {
+		case '<':  bwrite(ob, "&lt;",   4); break;
+		case '>':  bwrite(ob, "&gt;",   4); break;
+		case '\'': bwrite(ob, "&#39;",  5); break;
+		case '&':  bwrite(ob, "&amp;",  5); break;
+		case '"':  bwrite(ob, "&quot;", 6); break;
+		default:   return; /* NUL byte */
+		}
+		s += n + 1;
+		len -= n + 1;
+	}
+}
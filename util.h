@@ -0,0 +1,51 @@
+/* util.h - functions shared by stagit and stagit-index */
+#ifndef UTIL_H
+#define UTIL_H
+
+/* output buffer: written to fd when full, or kept in memory if fd is -1.
+   It is not locked, each buffer belongs to one thread. */
+struct obuf {
+	char *buf;
+	size_t len, cap;
+	int fd;
+	const char *name; /* for error messages */
+	/* a file of bopen() is kept in memory up to OBUFKEEP bytes, then
+	   written to the temporary file tmp. On bclose() it replaces the file
+	   base in dirfd only if their content differs */
+	int dirfd;
+	const char *base;
+	char *tmp;
+	unsigned long long total, hash; /* of the data written to tmp */
+	long long mtime;                /* of a replaced file if not 0 */
+};
+
+#define OBUFSIZ  (64 * 1024)
+#define OBUFKEEP (8 * 1024 * 1024)
+
+void binit(struct obuf *, int, const char *);
+void bopen(struct obuf *, const char *);
+void bopenat(struct obuf *, int, const char *, const char *);
+void bflush(struct obuf *);
+void bclose(struct obuf *);
+void bwrite(struct obuf *, const void *, size_t);
+void bputs(struct obuf *, const char *);
+void bputc(struct obuf *, int);
+void bputnum(struct obuf *, unsigned long long, int);
+void bprintf(struct obuf *, const char *, ...);
+
+/* called by bclose() for each file it adds ('A') or replaces ('M') */
+extern void (*bpublished)(const char *, int, unsigned long long,
+                          unsigned long long);
+
+#define FNV1AINIT 0xcbf29ce484222325ULL
+
+unsigned long long fnv1a(unsigned long long, const void *, size_t);
+int hashfile(int, const char *, unsigned long long *, unsigned long long *);
+
+int buringopen(void);
+void buringsync(void);
+void buringclose(void);
+
+void xmlencode(struct obuf *, const char *, size_t);
+
+#endif /* UTIL_H */